@@ -1,9 +1,32 @@
 #include "XrdPurgeLotMan.hh"
+#include "XrdPurgeLotManTrace.hh"
 
 #include <lotman/lotman.h>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+#ifdef XRDLOTMAN_USDT
+XRDLOTMAN_DEFINE_SEMAPHORE(lotman_call);
+XRDLOTMAN_DEFINE_SEMAPHORE(usage_update);
+XRDLOTMAN_DEFINE_SEMAPHORE(stage_start);
+XRDLOTMAN_DEFINE_SEMAPHORE(stage_done);
+XRDLOTMAN_DEFINE_SEMAPHORE(dir_claim);
+XRDLOTMAN_DEFINE_SEMAPHORE(cycle_done);
+#endif
 
 namespace XrdPfc {
 
@@ -17,449 +40,3108 @@ std::string getPolicyName(PurgePolicy policy) {
 		return "LotsPastOpp";
 	case PurgePolicy::PastDed:
 		return "LotsPastDed";
+	case PurgePolicy::PastObj:
+		return "LotsPastObj";
+	case PurgePolicy::SizeOrderedLRU:
+		return "SizeOrderedLRU";
 	default:
 		return "UnknownPolicy";
 	}
 }
 
 PurgePolicy getPolicyFromConfigName(const std::string &policy) {
-	if (policy == "del") {
-		return PurgePolicy::PastDel;
-	} else if (policy == "exp") {
-		return PurgePolicy::PastExp;
-	} else if (policy == "opp") {
-		return PurgePolicy::PastOpp;
-	} else if (policy == "ded") {
-		return PurgePolicy::PastDed;
-	} else {
-		return PurgePolicy::UnknownPolicy;
+	for (const auto &type : XrdPurgeLotMan::getPolicyStageTypes()) {
+		if (policy == type.configName) {
+			return type.policy;
+		}
 	}
+	return PurgePolicy::UnknownPolicy;
 }
 
-XrdPurgeLotMan::XrdPurgeLotMan()
-	: log(XrdPfc::Cache::GetInstance().GetLog()), m_purge_dirs{} {}
+bool parseBoolOption(const std::string &value, bool &result) {
+	if (value == "on" || value == "true" || value == "yes" || value == "1") {
+		result = true;
+		return true;
+	} else if (value == "off" || value == "false" || value == "no" ||
+			   value == "0") {
+		result = false;
+		return true;
+	}
+	return false;
+}
 
-XrdPurgeLotMan::~XrdPurgeLotMan() {}
+bool parseLogLevel(const std::string &value, LogLevel &result) {
+	if (value == "error") {
+		result = LogLevel::Error;
+	} else if (value == "warning") {
+		result = LogLevel::Warning;
+	} else if (value == "info") {
+		result = LogLevel::Info;
+	} else if (value == "debug") {
+		result = LogLevel::Debug;
+	} else {
+		return false;
+	}
+	return true;
+}
 
-long long XrdPurgeLotMan::GetConfiguredHWM() { return conf.m_diskUsageHWM; }
+void PurgeLog::Append(double value) {
+	char digits[32];
+	int len = snprintf(digits, sizeof(digits), "%g", value);
+	Append(std::string_view(digits, std::max(len, 0)));
+}
 
-long long XrdPurgeLotMan::GetConfiguredLWM() { return conf.m_diskUsageLWM; }
+void PurgeLog::Append(PurgePolicy policy) { Append(getPolicyName(policy)); }
 
-long long XrdPurgeLotMan::GetConfiguredFUsageBaseline() {
-	return conf.m_fileUsageBaseline;
+void PurgeLog::Append(const LogList &list) {
+	size_t count = 0;
+	if (list.names != nullptr) {
+		count = list.names->size();
+		for (size_t i = 0; i < count && i < LogList::kMaxItems; ++i) {
+			Append(i > 0 ? ", " : "");
+			Append((*list.names)[i]);
+		}
+	} else if (list.items != nullptr) {
+		for (; list.items[count] != nullptr; ++count) {
+			if (count < LogList::kMaxItems) {
+				Append(count > 0 ? ", " : "");
+				Append(list.items[count]);
+			}
+		}
+	}
+	if (count > LogList::kMaxItems) {
+		Append(", ... (");
+		Append(count);
+		Append(" in total)");
+	}
 }
 
-long long XrdPurgeLotMan::GetConfiguredFUsageNominal() {
-	return conf.m_fileUsageNominal;
+long long scaleBytes(long long bytes, long long numerator,
+					 long long denominator) {
+	if (denominator <= 0) {
+		return 0;
+	}
+	// bytes = q * denominator + r, so only r * numerator needs to fit
+	return bytes / denominator * numerator +
+		   bytes % denominator * numerator / denominator;
 }
 
-long long XrdPurgeLotMan::GetConfiguredFUsageMax() {
-	return conf.m_fileUsageMax;
+long long nominalTierTargetB(long long usageB, long long nominalB,
+							 long long maxB, long long budgetB) {
+	if (nominalB <= 0 || nominalB >= maxB || usageB <= nominalB ||
+		usageB >= maxB) {
+		return 0;
+	}
+	if (budgetB <= 0) {
+		budgetB = std::max((maxB - nominalB) / 10, 1ll);
+	}
+	return std::min(usageB - nominalB, budgetB);
 }
 
-struct XrdPurgeLotMan::LotDeleter {
-	void operator()(char **ptr) { lotman_free_string_list(ptr); }
-};
+std::string normalizeDirPath(const std::string &path) {
+	std::string normalized = path;
+	while (normalized.size() > 1 && normalized.back() == '/') {
+		normalized.pop_back();
+	}
+	return normalized;
+}
 
-// Gets all the root lots and tallies up their usage. Used to construct the
-// total number of bytes to clear on each purge loop by comparing with
-// configured HWM/LWM.
-long long XrdPurgeLotMan::getTotalUsageB() {
-	// Get all lots, and aggregate those that are rootly
-	char **rawLots = nullptr;
-	char *err;
-	auto rv = lotman_list_all_lots(&rawLots, &err);
-	std::unique_ptr<char *[], LotDeleter> lots(rawLots, LotDeleter());
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "getTotalUsageB",
-				  ("Error getting all lots: " + std::string(err)).c_str());
-		return 0;
+void runInParallel(size_t nTasks, unsigned nThreads,
+				   const std::function<void(size_t)> &task) {
+	nThreads = std::max(1u, std::min<unsigned>(nThreads, nTasks));
+	if (nThreads == 1) {
+		for (size_t i = 0; i < nTasks; ++i) {
+			task(i);
+		}
+		return;
 	}
 
-	// For each lot, check if it's a root lot, and if so get its total usage
-	long long totalUsage = 0;
-	for (int i = 0; lots[i] != nullptr; ++i) {
-		std::string lotName = lots[i];
-		// Check if the lot is a root lot
-		if (int rc = lotman_is_root(lotName.c_str(), &err); rc != 1) {
-			// Not root, or an error
-			if (rc < 0) {
-				log->Emsg("XrdPurgeLotMan", "getTotalUsageB",
-						  ("Error checking if lot '" + lotName +
-						   "' is root: " + std::string(err))
-							  .c_str());
+	std::atomic<size_t> next{0};
+	std::exception_ptr firstError;
+	std::mutex errorMutex;
+	auto worker = [&]() {
+		for (size_t i = next++; i < nTasks; i = next++) {
+			try {
+				task(i);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (!firstError) {
+					firstError = std::current_exception();
+				}
 			}
+		}
+	};
 
-			continue;
-		} else {
-			// Root lot. Get the total usage.
-			json usageQueryJSON;
-			usageQueryJSON["lot_name"] = lotName;
-			usageQueryJSON["total_GB"] = true;
+	std::vector<std::thread> threads;
+	threads.reserve(nThreads - 1);
+	for (unsigned t = 1; t < nThreads; ++t) {
+		threads.emplace_back(worker);
+	}
+	worker();
+	for (auto &thread : threads) {
+		thread.join();
+	}
 
-			char *output;
-			rv = lotman_get_lot_usage(usageQueryJSON.dump().c_str(), &output,
-									  &err);
-			if (rv != 0) {
-				std::unique_ptr<char, decltype(&free)> err_ptr(err, free);
-				continue;
-			}
+	if (firstError) {
+		std::rethrow_exception(firstError);
+	}
+}
 
-			std::unique_ptr<char, decltype(&free)> output_ptr(output, free);
-			json usageJSON = json::parse(output_ptr.get());
-			double totalGB = usageJSON["total_GB"]["total"];
-			totalUsage += static_cast<long long>(totalGB * GB2B);
+DirTree::DirTree(const DataFsPurgeshot &purge_shot) {
+	const auto &dirVec = purge_shot.m_dir_vec;
+	const size_t n = dirVec.size();
+	m_parent.resize(n);
+	m_name_offset.resize(n);
+	m_name_len.resize(n);
+	m_child_offset.assign(n + 1, 0);
+
+	// Reserve enough room for every name up front so the views used for
+	// interning stay valid while the arena fills up
+	size_t totalNameLen = 0;
+	for (const auto &dir_entry : dirVec) {
+		totalNameLen += dir_entry.m_dir_name.size();
+	}
+	m_names.reserve(totalNameLen);
+
+	std::unordered_map<std::string_view, uint32_t> interned;
+	for (size_t i = 0; i < n; ++i) {
+		const auto &dir_entry = dirVec[i];
+		m_parent[i] = dir_entry.m_parent;
+		if (dir_entry.m_parent >= 0) {
+			++m_child_offset[dir_entry.m_parent + 1];
+		}
+
+		const std::string &name = dir_entry.m_dir_name;
+		auto it = interned.find(name);
+		if (it == interned.end()) {
+			uint32_t offset = static_cast<uint32_t>(m_names.size());
+			m_names.append(name);
+			it = interned
+					 .emplace(std::string_view(m_names).substr(offset,
+															   name.size()),
+							  offset)
+					 .first;
 		}
+		m_name_offset[i] = it->second;
+		m_name_len[i] = static_cast<uint32_t>(name.size());
 	}
 
-	return totalUsage;
+	// Lay the children out contiguously, grouped by parent and in the same
+	// order they appear in the purge shot
+	for (size_t i = 0; i < n; ++i) {
+		m_child_offset[i + 1] += m_child_offset[i];
+	}
+	m_children.resize(m_child_offset[n]);
+	std::vector<uint32_t> fill(m_child_offset.begin(),
+							   m_child_offset.end() - 1);
+	for (size_t i = 0; i < n; ++i) {
+		if (m_parent[i] >= 0) {
+			m_children[fill[m_parent[i]]++] = static_cast<uint32_t>(i);
+		}
+	}
+
+	// Daughters always come after their parent, so a single backwards pass
+	// is enough
+	m_subtree_size.assign(n, 1);
+	for (size_t i = n; i-- > 1;) {
+		if (m_parent[i] >= 0) {
+			m_subtree_size[m_parent[i]] += m_subtree_size[i];
+		}
+	}
 }
 
-// Given a lot name, get its associated directories and deduce their usage from
-// the purge_shot's statistics
-std::map<std::string, long long>
-XrdPurgeLotMan::lotPerDirUsageB(const std::string &lot,
-								const DataFsPurgeshot &purge_shot) {
-	std::map<std::string, long long> usageMap;
-	char *dirs; // will hold a JSON list of lot usage objects
-	char *err;
-	auto rv = lotman_get_lot_dirs(lot.c_str(), true, &dirs, &err);
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "lotPerDirUsageB",
-				  ("Error getting dirs in lot " + lot + ": " + std::string(err))
-					  .c_str());
-		return usageMap;
+int DirTree::Depth(int idx) const {
+	int depth = 0;
+	for (int p = m_parent[idx]; p != -1; p = m_parent[p]) {
+		++depth;
 	}
+	return depth;
+}
 
-	json dirsJSON = json::parse(dirs);
-	// Iterate through JSON list of objects, get the name of each directory
-	for (const auto &dir : dirsJSON) {
-		std::string path = dir["path"];
-		// Get the usage for the directory
-		const DirUsage *dirUsage = purge_shot.find_dir_usage_for_dir_path(path);
-		if (dirUsage == nullptr) {
-			log->Emsg("XrdPurgeLotMan", "lotPerDirUsageB",
-					  ("Error finding usage for directory " + path).c_str());
-			continue;
-		}
-		long long bytesToRecover =
-			static_cast<long long>(dirUsage->m_StBlocks) * BLKSZ;
-		usageMap[path] = bytesToRecover;
+std::string DirTree::Path(int idx) const {
+	std::vector<int> chain;
+	for (int i = idx; m_parent[i] != -1; i = m_parent[i]) {
+		chain.push_back(i);
 	}
 
-	return usageMap;
+	std::string path;
+	for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+		path += '/';
+		path += Name(*it);
+	}
+	return path.empty() ? "/" : path;
 }
 
-/*
-A set of policy wrappers that call the appropriate underlying type of policy
-function, which can either entail a total purge policy (for things like
-deletable/expired lots) or partial purge (for lots past dedicated/opportunistic
-quotas).
-*/
-void XrdPurgeLotMan::lotsPastDelPolicy(const DataFsPurgeshot &purgeShot,
-									   long long &bytesRemaining) {
-	PurgePolicy policy = PurgePolicy::PastDel;
-	completePurgePolicyBase(purgeShot, bytesRemaining, policy);
+int DirTree::Find(const std::string &path) const {
+	if (m_parent.empty() || path.empty() || path[0] != '/') {
+		return -1;
+	}
+
+	int idx = 0;
+	std::string_view rest(path);
+	while (!rest.empty()) {
+		size_t start = rest.find_first_not_of('/');
+		if (start == std::string_view::npos) {
+			break;
+		}
+		rest.remove_prefix(start);
+		std::string_view component = rest.substr(0, rest.find('/'));
+		rest.remove_prefix(component.size());
+
+		int next = -1;
+		for (auto child = ChildrenBegin(idx); child != ChildrenEnd(idx);
+			 ++child) {
+			if (Name(*child) == component) {
+				next = static_cast<int>(*child);
+				break;
+			}
+		}
+		if (next == -1) {
+			return -1;
+		}
+		idx = next;
+	}
+
+	return idx;
 }
 
-void XrdPurgeLotMan::lotsPastExpPolicy(const DataFsPurgeshot &purgeShot,
-									   long long &bytesRemaining) {
-	PurgePolicy policy = PurgePolicy::PastExp;
-	completePurgePolicyBase(purgeShot, bytesRemaining, policy);
+bool DirTree::IsAt(int idx, std::string_view path) const {
+	if (idx < 0 || static_cast<size_t>(idx) >= Size()) {
+		return false;
+	}
+
+	// Match the path's components from the last one up
+	for (int i = idx; m_parent[i] != -1; i = m_parent[i]) {
+		while (!path.empty() && path.back() == '/') {
+			path.remove_suffix(1);
+		}
+		std::string_view name = Name(i);
+		if (path.size() <= name.size() ||
+			path.substr(path.size() - name.size()) != name) {
+			return false;
+		}
+		path.remove_suffix(name.size());
+		if (path.back() != '/') {
+			return false;
+		}
+	}
+	return path.find_first_not_of('/') == std::string_view::npos;
 }
 
-void XrdPurgeLotMan::lotsPastOppPolicy(const DataFsPurgeshot &purgeShot,
-									   long long &bytesRemaining) {
-	PurgePolicy policy = PurgePolicy::PastOpp;
-	partialPurgePolicyBase(purgeShot, bytesRemaining, policy);
+size_t DirTree::MemoryUsage() const {
+	return m_parent.capacity() * sizeof(int32_t) +
+		   (m_child_offset.capacity() + m_children.capacity() +
+			m_name_offset.capacity() + m_name_len.capacity() +
+			m_subtree_size.capacity()) *
+			   sizeof(uint32_t) +
+		   m_names.capacity();
 }
 
-void XrdPurgeLotMan::lotsPastDedPolicy(const DataFsPurgeshot &purgeShot,
-									   long long &bytesRemaining) {
-	PurgePolicy policy = PurgePolicy::PastDed;
-	partialPurgePolicyBase(purgeShot, bytesRemaining, policy);
+DirTree::PathIterator::PathIterator(const DirTree &tree, int start)
+	: m_tree{tree} {
+	if (start >= 0 && static_cast<size_t>(start) < tree.Size()) {
+		m_path = tree.Path(start);
+		m_stack.emplace_back(start, m_path.size());
+	}
 }
 
-/*
-END POLICY WRAPPERS
-*/
+void DirTree::PathIterator::Next() {
+	int idx = m_stack.back().first;
+	m_stack.pop_back();
 
-// Scaffolding for policies that require purging the entire lot
-void XrdPurgeLotMan::completePurgePolicyBase(const DataFsPurgeshot &purgeShot,
-											 long long &globalBRemaining,
-											 XrdPfc::PurgePolicy policy) {
-	char **lots;
-	char *err;
-	int rv{-1};
+	// Push the children in reverse so they come off the stack in order
+	const size_t parentLen = m_path.size();
+	for (auto child = m_tree.ChildrenEnd(idx);
+		 child != m_tree.ChildrenBegin(idx);) {
+		--child;
+		m_stack.emplace_back(*child, parentLen);
+	}
+	enterTop();
+}
 
-	switch (policy) {
-	case XrdPfc::PurgePolicy::PastDel:
-		rv = lotman_get_lots_past_del(true, &lots, &err);
-		break;
-	case XrdPfc::PurgePolicy::PastExp:
-		rv = lotman_get_lots_past_exp(true, &lots, &err);
-		break;
-	default:
-		log->Emsg(
-			"XrdPurgeLotMan", "completePurgePolicyBase",
-			("Unexpected purge policy: " + getPolicyName(policy)).c_str());
+void DirTree::PathIterator::enterTop() {
+	if (m_stack.empty()) {
 		return;
 	}
-	std::unique_ptr<char *[], LotDeleter> lots_total_purge(lots, LotDeleter());
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "completePurgePolicyBase",
-				  ("Error getting lots for policy " + getPolicyName(policy) +
-				   ": " + std::string(err))
-					  .c_str());
+
+	auto [idx, parentLen] = m_stack.back();
+	m_path.resize(parentLen);
+	if (m_path.empty() || m_path.back() != '/') {
+		m_path += '/';
+	}
+	m_path += m_tree.Name(idx);
+}
+
+json dirTreeToJson(const DirTree &tree, int idx,
+				   const DataFsPurgeshot &purge_shot) {
+	nlohmann::json dirJson;
+	dirJson["path"] = std::string(tree.Name(idx));
+	dirJson["size_GB"] =
+		bytesToGB(purge_shot.m_dir_vec[idx].m_usage.m_StBlocks * BLKSZ);
+
+	if (tree.NumChildren(idx) > 0) {
+		dirJson["includes_subdirs"] = true;
+		for (auto child = tree.ChildrenBegin(idx);
+			 child != tree.ChildrenEnd(idx); ++child) {
+			dirJson["subdirs"].push_back(
+				dirTreeToJson(tree, *child, purge_shot));
+		}
+	} else {
+		dirJson["includes_subdirs"] = false;
+	}
+
+	return dirJson;
+}
+
+json reconstructPathsAndBuildJson(const DirTree &tree,
+								  const DataFsPurgeshot &purge_shot,
+								  unsigned nThreads) {
+	nlohmann::json allDirsJson = nlohmann::json::array();
+	if (tree.Size() == 0) {
+		return allDirsJson;
+	}
+
+	// The root directory itself is never sent, only its subdirectories
+	if (nThreads <= 1) {
+		for (auto root = tree.ChildrenBegin(0); root != tree.ChildrenEnd(0);
+			 ++root) {
+			allDirsJson.push_back(dirTreeToJson(tree, *root, purge_shot));
+		}
+		return allDirsJson;
+	}
+
+	const size_t splitAbove =
+		std::max<size_t>(tree.Size() / (4 * nThreads), 1);
+
+	std::vector<std::pair<int, json *>> tasks;
+	std::function<void(int, json &)> planSubtree = [&](int idx, json &slot) {
+		if (tree.SubtreeSize(idx) <= splitAbove ||
+			tree.NumChildren(idx) == 0) {
+			tasks.emplace_back(idx, &slot);
+			return;
+		}
+
+		// Fill in this directory now and hand its subdirectories out
+		slot["path"] = std::string(tree.Name(idx));
+		slot["size_GB"] =
+			bytesToGB(purge_shot.m_dir_vec[idx].m_usage.m_StBlocks * BLKSZ);
+		slot["includes_subdirs"] = true;
+		slot["subdirs"] = json::array();
+		// Reserve every slot before recursing so they don't move
+		auto &subdirs = slot["subdirs"].get_ref<json::array_t &>();
+		subdirs.resize(tree.NumChildren(idx));
+		size_t i = 0;
+		for (auto child = tree.ChildrenBegin(idx);
+			 child != tree.ChildrenEnd(idx); ++child) {
+			planSubtree(*child, subdirs[i++]);
+		}
+	};
+
+	auto &allDirs = allDirsJson.get_ref<json::array_t &>();
+	allDirs.resize(tree.NumChildren(0));
+	size_t i = 0;
+	for (auto root = tree.ChildrenBegin(0); root != tree.ChildrenEnd(0);
+		 ++root) {
+		planSubtree(*root, allDirs[i++]);
+	}
+
+	// Hand out the biggest subtrees first so a large one started late doesn't
+	// hold everyone else up
+	std::stable_sort(tasks.begin(), tasks.end(),
+					 [&tree](const auto &a, const auto &b) {
+						 return tree.SubtreeSize(a.first) >
+								tree.SubtreeSize(b.first);
+					 });
+	runInParallel(tasks.size(), nThreads, [&](size_t i) {
+		*tasks[i].second = dirTreeToJson(tree, tasks[i].first, purge_shot);
+	});
+
+	return allDirsJson;
+}
+
+std::vector<long long> dirBlockCounts(const DataFsPurgeshot &purge_shot) {
+	std::vector<long long> blocks;
+	blocks.reserve(purge_shot.m_dir_vec.size());
+	for (const auto &dir_entry : purge_shot.m_dir_vec) {
+		blocks.push_back(dir_entry.m_usage.m_StBlocks);
+	}
+	return blocks;
+}
+
+// Append a string to `out` as a quoted JSON string
+static void appendJsonString(std::string &out, std::string_view value) {
+	static const char hex[] = "0123456789abcdef";
+	out += '"';
+	for (char c : value) {
+		switch (c) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\b':
+			out += "\\b";
+			break;
+		case '\f':
+			out += "\\f";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\r':
+			out += "\\r";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		default:
+			if (static_cast<unsigned char>(c) < 0x20) {
+				out += "\\u00";
+				out += hex[(c >> 4) & 0xf];
+				out += hex[c & 0xf];
+			} else {
+				out += c;
+			}
+		}
+	}
+	out += '"';
+}
+
+// Append everything but the subdirectories of a directory's usage update
+// object, leaving the object open
+static void appendDirJsonHead(std::string &out, const DirTree &tree, int idx,
+							  const std::vector<long long> &dirBlocks) {
+	// Keys in the same order json::dump() puts them in
+	out += tree.NumChildren(idx) > 0 ? "{\"includes_subdirs\":true"
+									 : "{\"includes_subdirs\":false";
+	out += ",\"path\":";
+	appendJsonString(out, tree.Name(idx));
+	out += ",\"size_GB\":";
+
+	// Shortest representation that reads back as the same double. Keep it a
+	// floating point number even when it's whole, as json::dump() does.
+	char buf[32];
+	auto [end, ec] = std::to_chars(buf, buf + sizeof(buf),
+								   bytesToGB(dirBlocks[idx] * BLKSZ));
+	out.append(buf, end);
+	if (std::find_if(buf, end, [](char c) { return c == '.' || c == 'e'; }) ==
+		end) {
+		out += ".0";
+	}
+}
+
+void appendDirTreeJson(std::string &out, const DirTree &tree, int idx,
+					   const std::vector<long long> &dirBlocks) {
+	// Directories whose subdirectories are still being written, along with
+	// the next one to write
+	std::vector<std::pair<int, const uint32_t *>> open;
+	appendDirJsonHead(out, tree, idx, dirBlocks);
+	if (tree.NumChildren(idx) == 0) {
+		out += '}';
 		return;
 	}
-	log->Emsg("XrdPurgeLotMan", "completePurgePolicyBase",
-			  ("Purge policy " + getPolicyName(policy) +
-			   " requires clearing lots: " + convertListToString(lots))
-				  .c_str());
+	out += ",\"subdirs\":[";
+	open.emplace_back(idx, tree.ChildrenBegin(idx));
+
+	while (!open.empty()) {
+		auto &[dir, next] = open.back();
+		if (next == tree.ChildrenEnd(dir)) {
+			out += "]}";
+			open.pop_back();
+			continue;
+		}
+		if (next != tree.ChildrenBegin(dir)) {
+			out += ',';
+		}
+		const int child = static_cast<int>(*next++);
+		appendDirJsonHead(out, tree, child, dirBlocks);
+		if (tree.NumChildren(child) == 0) {
+			out += '}';
+		} else {
+			out += ",\"subdirs\":[";
+			open.emplace_back(child, tree.ChildrenBegin(child));
+		}
+	}
+}
+
+std::vector<std::string> serializeDirTrees(
+	const DirTree &tree, const std::vector<long long> &dirBlocks,
+	const std::vector<int> &dirs, unsigned nThreads) {
+	std::vector<std::string> result(dirs.size());
+	if (nThreads <= 1) {
+		for (size_t i = 0; i < dirs.size(); ++i) {
+			appendDirTreeJson(result[i], tree, dirs[i], dirBlocks);
+		}
+		return result;
+	}
+
+	size_t totalDirs = 0;
+	for (int dir : dirs) {
+		totalDirs += tree.SubtreeSize(dir);
+	}
+	const size_t splitAbove = std::max<size_t>(totalDirs / (4 * nThreads), 1);
+
+	// Each directory's string is put together from pieces: the parts of
+	// split up directories that are written up front, and whole subtrees
+	// that are serialized by the tasks
+	struct Piece {
+		int task{-1};
+		std::string text;
+	};
+	std::vector<std::vector<Piece>> pieces(dirs.size());
+	std::vector<int> tasks;
+	std::vector<std::string> taskOutput;
+	std::function<void(int, std::vector<Piece> &)> planSubtree =
+		[&](int idx, std::vector<Piece> &out) {
+			if (tree.SubtreeSize(idx) <= splitAbove ||
+				tree.NumChildren(idx) == 0) {
+				out.push_back({static_cast<int>(tasks.size()), {}});
+				tasks.push_back(idx);
+				return;
+			}
+
+			auto text = [&out]() -> std::string & {
+				if (out.empty() || out.back().task != -1) {
+					out.emplace_back();
+				}
+				return out.back().text;
+			};
+			appendDirJsonHead(text(), tree, idx, dirBlocks);
+			text() += ",\"subdirs\":[";
+			for (auto child = tree.ChildrenBegin(idx);
+				 child != tree.ChildrenEnd(idx); ++child) {
+				if (child != tree.ChildrenBegin(idx)) {
+					text() += ',';
+				}
+				planSubtree(*child, out);
+			}
+			text() += "]}";
+		};
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		planSubtree(dirs[i], pieces[i]);
+	}
+
+	// Hand out the biggest subtrees first so a large one started late doesn't
+	// hold everyone else up
+	std::vector<size_t> order(tasks.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return tree.SubtreeSize(tasks[a]) > tree.SubtreeSize(tasks[b]);
+	});
+	taskOutput.resize(tasks.size());
+	runInParallel(order.size(), nThreads, [&](size_t i) {
+		appendDirTreeJson(taskOutput[order[i]], tree, tasks[order[i]],
+						  dirBlocks);
+	});
+
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		size_t size = 0;
+		for (const auto &piece : pieces[i]) {
+			size += piece.task == -1 ? piece.text.size()
+									 : taskOutput[piece.task].size();
+		}
+		result[i].reserve(size);
+		for (auto &piece : pieces[i]) {
+			if (piece.task == -1) {
+				result[i] += piece.text;
+			} else {
+				result[i] += taskOutput[piece.task];
+				// Done with it, so don't hold on to it until the end
+				std::string().swap(taskOutput[piece.task]);
+			}
+		}
+	}
+	return result;
+}
+
+// The lot each directory of the tree belongs to, as an index into lotNames,
+// or -1 if none. lotNames is filled with the lots in name order.
+static std::vector<int>
+assignLotOwners(const DirTree &tree, const std::map<std::string, LotInfo> &lots,
+				std::vector<const std::string *> &lotNames) {
+	// Registered owner of each directory, and the lot whose recursive path
+	// covers it, as indices into lotNames
+	std::vector<int> owner(tree.Size(), -1);
+	std::vector<int> recursiveOwner(tree.Size(), -1);
+	std::vector<bool> registeredRecursive(tree.Size(), false);
+	for (const auto &[lotName, info] : lots) {
+		lotNames.push_back(&lotName);
+		for (const auto &[path, recursive] : info.paths) {
+			int idx = tree.Find(path);
+			if (idx != -1 && owner[idx] == -1) {
+				owner[idx] = static_cast<int>(lotNames.size()) - 1;
+				registeredRecursive[idx] = recursive;
+			}
+		}
+	}
+
+	// Daughters always come after their parent, so owners can be handed down
+	// in index order
+	for (size_t i = 0; i < tree.Size(); ++i) {
+		int parentCover =
+			tree.Parent(i) >= 0 ? recursiveOwner[tree.Parent(i)] : -1;
+		if (owner[i] == -1) {
+			owner[i] = parentCover;
+			recursiveOwner[i] = parentCover;
+		} else {
+			recursiveOwner[i] = registeredRecursive[i] ? owner[i] : parentCover;
+		}
+	}
+	return owner;
+}
+
+std::map<std::string, LotUsage>
+aggregateLotUsage(const DirTree &tree, const DataFsPurgeshot &purge_shot,
+				  const std::map<std::string, LotInfo> &lots) {
+	std::map<std::string, LotUsage> usage;
+	std::vector<const std::string *> lotNames;
+	const std::vector<int> owner = assignLotOwners(tree, lots, lotNames);
+	int defaultLot = -1;
+	for (size_t l = 0; l < lotNames.size(); ++l) {
+		usage[*lotNames[l]];
+		if (*lotNames[l] == "default") {
+			defaultLot = static_cast<int>(l);
+		}
+	}
+	if (tree.Size() == 0) {
+		return usage;
+	}
+
+	// Usage is added up in reverse. Each directory's usage includes its
+	// subdirectories', so what's left after taking those out is its own.
+	std::vector<long long> selfB(lotNames.size(), 0);
+	std::vector<long long> selfObjects(lotNames.size(), 0);
+	std::vector<long long> subdirBlocks(tree.Size(), 0);
+	std::vector<long long> subdirFiles(tree.Size(), 0);
+	for (size_t i = tree.Size(); i-- > 0;) {
+		const DirUsage &dirUsage = purge_shot.m_dir_vec[i].m_usage;
+		if (tree.Parent(i) >= 0) {
+			subdirBlocks[tree.Parent(i)] += dirUsage.m_StBlocks;
+			subdirFiles[tree.Parent(i)] += dirUsage.m_NFiles;
+		}
+		// Like LotMan, count directories no lot claims towards the default
+		// lot. The root itself is never sent to LotMan, so its own files
+		// don't count towards any lot.
+		const int lot = owner[i] != -1 || i == 0 ? owner[i] : defaultLot;
+		if (lot != -1) {
+			selfB[lot] +=
+				std::max(dirUsage.m_StBlocks - subdirBlocks[i], 0ll) * BLKSZ;
+			selfObjects[lot] +=
+				std::max<long long>(dirUsage.m_NFiles - subdirFiles[i], 0);
+		}
+	}
+
+	for (size_t l = 0; l < lotNames.size(); ++l) {
+		LotUsage &lotUsage = usage[*lotNames[l]];
+		lotUsage.selfB = selfB[l];
+		lotUsage.selfObjects = selfObjects[l];
+	}
+
+	// A lot's total covers all its descendants, which may be shared between
+	// parents, so each lot is totalled once and reused
+	std::unordered_set<std::string> done, inProgress;
+	std::function<void(const std::string &)> total =
+		[&](const std::string &lotName) {
+			if (done.count(lotName) || !inProgress.insert(lotName).second) {
+				return;
+			}
+			LotUsage &lotUsage = usage[lotName];
+			lotUsage.totalB = lotUsage.selfB;
+			lotUsage.totalObjects = lotUsage.selfObjects;
+			for (const auto &child : lots.at(lotName).children) {
+				if (!lots.count(child)) {
+					continue;
+				}
+				total(child);
+				lotUsage.totalB += usage[child].totalB;
+				lotUsage.totalObjects += usage[child].totalObjects;
+			}
+			inProgress.erase(lotName);
+			done.insert(lotName);
+		};
+	for (const auto *lotName : lotNames) {
+		total(*lotName);
+	}
+
+	return usage;
+}
+
+std::unordered_map<std::string, size_t>
+groupTopLevelDirsByLot(const DirTree &tree,
+					   const std::map<std::string, LotInfo> &lots) {
+	std::unordered_map<std::string, size_t> groups;
+	if (tree.Size() == 0) {
+		return groups;
+	}
+
+	std::vector<const std::string *> lotNames;
+	const std::vector<int> owner = assignLotOwners(tree, lots, lotNames);
+	// LotMan counts directories no lot claims towards the default lot, which
+	// gets a slot of its own if it isn't in the cache
+	int defaultLot = static_cast<int>(lotNames.size());
+	for (size_t l = 0; l < lotNames.size(); ++l) {
+		if (*lotNames[l] == "default") {
+			defaultLot = static_cast<int>(l);
+		}
+	}
+
+	// Lots that share a top-level directory end up in the same set
+	std::vector<int> parent(lotNames.size() + 1);
+	std::iota(parent.begin(), parent.end(), 0);
+	std::function<int(int)> find = [&](int l) {
+		return parent[l] == l ? l : parent[l] = find(parent[l]);
+	};
+
+	// Top-level directory above each directory, and the first lot found
+	// under each top-level directory
+	std::vector<int> topLevel(tree.Size(), -1);
+	std::vector<int> firstLot(tree.Size(), -1);
+	for (size_t i = 1; i < tree.Size(); ++i) {
+		const int p = tree.Parent(i);
+		if (p < 0) {
+			continue;
+		}
+		topLevel[i] = p == 0 ? static_cast<int>(i) : topLevel[p];
+		if (topLevel[i] == -1) {
+			continue;
+		}
+		const int lot = owner[i] == -1 ? defaultLot : owner[i];
+		int &first = firstLot[topLevel[i]];
+		if (first == -1) {
+			first = lot;
+		} else {
+			parent[find(lot)] = find(first);
+		}
+	}
+
+	for (auto top = tree.ChildrenBegin(0); top != tree.ChildrenEnd(0); ++top) {
+		groups[std::string(tree.Name(*top))] = find(firstLot[*top]);
+	}
+	return groups;
+}
+
+LotDirIndex::LotDirIndex(const DirTree &tree,
+						 const DataFsPurgeshot &purge_shot,
+						 const std::map<std::string, LotInfo> &lots) {
+	for (const auto &[lotName, info] : lots) {
+		for (const auto &path : info.paths) {
+			std::string dir = normalizeDirPath(path.first);
+			auto [it, added] = m_by_path.try_emplace(dir, m_entries.size());
+			if (added) {
+				m_entries.emplace_back();
+				m_entries.back().path = std::move(dir);
+			}
+			auto &owners = m_entries[it->second].owners;
+			if (owners.empty() || owners.back() != lotName) {
+				owners.push_back(lotName);
+			}
+		}
+	}
+	Update(tree, purge_shot);
+}
+
+std::unordered_set<std::string>
+LotDirIndex::Update(const DirTree &tree, const DataFsPurgeshot &purge_shot) {
+	std::unordered_set<std::string> changed;
+	auto markChanged = [&changed](const Entry &entry) {
+		changed.insert(entry.owners.begin(), entry.owners.end());
+	};
+
+	bool appearedOrWent = false;
+	for (auto &entry : m_entries) {
+		const int idx = tree.IsAt(entry.idx, entry.path)
+							? entry.idx
+							: tree.Find(entry.path);
+		if ((idx == -1) != (entry.idx == -1)) {
+			appearedOrWent = true;
+			markChanged(entry);
+		}
+		entry.idx = idx;
+	}
+	if (appearedOrWent) {
+		findNesting(tree);
+	}
+
+	auto recursiveB = [&](int idx) {
+		return static_cast<long long>(
+				   purge_shot.m_dir_vec[idx].m_usage.m_StBlocks) *
+			   BLKSZ;
+	};
+	for (auto &entry : m_entries) {
+		long long exclusiveB = 0;
+		if (entry.idx != -1) {
+			exclusiveB = recursiveB(entry.idx);
+			for (size_t nested : entry.nested) {
+				exclusiveB -= recursiveB(m_entries[nested].idx);
+			}
+		}
+		if (exclusiveB != entry.exclusiveB) {
+			entry.exclusiveB = exclusiveB;
+			markChanged(entry);
+		}
+	}
+	return changed;
+}
+
+void LotDirIndex::findNesting(const DirTree &tree) {
+	std::unordered_map<int, size_t> byIdx;
+	for (size_t i = 0; i < m_entries.size(); ++i) {
+		m_entries[i].nested.clear();
+		if (m_entries[i].idx != -1) {
+			byIdx.emplace(m_entries[i].idx, i);
+		}
+	}
+
+	// Each lot directory's usage is taken out of the closest lot directory
+	// above it, which is the only one that counted it twice
+	for (const auto &[idx, pos] : byIdx) {
+		for (int p = tree.Parent(idx); p != -1; p = tree.Parent(p)) {
+			auto it = byIdx.find(p);
+			if (it != byIdx.end()) {
+				m_entries[it->second].nested.push_back(pos);
+				break;
+			}
+		}
+	}
+}
+
+const LotDirIndex::Entry *LotDirIndex::Find(const std::string &dir) const {
+	auto it = m_by_path.find(dir);
+	if (it == m_by_path.end() || m_entries[it->second].idx == -1) {
+		return nullptr;
+	}
+	return &m_entries[it->second];
+}
+
+size_t LotDirIndex::Size() const {
+	return std::count_if(m_entries.begin(), m_entries.end(),
+						 [](const Entry &entry) { return entry.idx != -1; });
+}
+
+UsageUpdatePipeline::UsageUpdatePipeline(SendFn send, size_t maxQueued)
+	: m_send{std::move(send)}, m_max_queued{std::max<size_t>(maxQueued, 1)},
+	  m_thread{&UsageUpdatePipeline::run, this} {}
+
+UsageUpdatePipeline::~UsageUpdatePipeline() { Finish(); }
+
+bool UsageUpdatePipeline::Push(std::string update, size_t numDirs) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cv.wait(lock,
+			  [this] { return m_failed || m_queue.size() < m_max_queued; });
+	if (m_failed) {
+		return false;
+	}
+	m_queue.emplace_back(std::move(update), numDirs);
+	++m_num_batches;
+	m_cv.notify_all();
+	return true;
+}
+
+bool UsageUpdatePipeline::Finish() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+	}
+	m_cv.notify_all();
+	if (m_thread.joinable()) {
+		m_thread.join();
+	}
+	return !m_failed;
+}
+
+void UsageUpdatePipeline::run() {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_cv.wait(lock, [this] { return m_closed || !m_queue.empty(); });
+		if (m_queue.empty()) {
+			// Closed, and everything has been sent
+			return;
+		}
+		auto [update, numDirs] = std::move(m_queue.front());
+		m_queue.pop_front();
+		lock.unlock();
+		m_cv.notify_all();
+
+		bool sent = m_send(update, numDirs);
+
+		lock.lock();
+		if (!sent) {
+			m_failed = true;
+			m_queue.clear();
+			m_cv.notify_all();
+		}
+	}
+}
+
+std::vector<PurgeCandidate> collapseNestedCandidates(
+	const DirTree &tree, const DataFsPurgeshot &purge_shot,
+	const std::map<std::string, std::unique_ptr<PurgeDirCandidateStats>>
+		&candidates) {
+	std::vector<PurgeCandidate> result;
+	result.reserve(candidates.size());
+	// Candidates we could place in the tree, as (depth, idx, result position)
+	std::vector<std::tuple<int, int, size_t>> placed;
+	for (const auto &[dir, stats] : candidates) {
+		result.push_back({dir, stats->dir_b_to_purge, stats->lot_name});
+		int idx = tree.Find(normalizeDirPath(dir));
+		if (idx != -1) {
+			placed.emplace_back(tree.Depth(idx), idx, result.size() - 1);
+		}
+	}
+
+	// Visit shallow candidates first so every candidate's ancestors have
+	// already been resolved to the outermost candidate that contains them.
+	std::stable_sort(placed.begin(), placed.end(),
+					 [](const auto &a, const auto &b) {
+						 return std::get<0>(a) < std::get<0>(b);
+					 });
+
+	std::unordered_map<int, size_t> idxToOutermost;
+	std::vector<bool> absorbed(result.size(), false);
+	for (const auto &[depth, idx, pos] : placed) {
+		(void)depth;
+		size_t outermost = pos;
+		for (int p = tree.Parent(idx); p != -1; p = tree.Parent(p)) {
+			auto it = idxToOutermost.find(p);
+			if (it != idxToOutermost.end()) {
+				outermost = it->second;
+				break;
+			}
+		}
+		idxToOutermost[idx] = outermost;
+
+		if (outermost != pos) {
+			absorbed[pos] = true;
+			result[outermost].bytesToRecover += result[pos].bytesToRecover;
+		}
+	}
+
+	// Never ask for more than the outermost directory actually holds
+	for (const auto &[depth, idx, pos] : placed) {
+		(void)depth;
+		if (!absorbed[pos]) {
+			long long subtreeB =
+				purge_shot.m_dir_vec[idx].m_usage.m_StBlocks * BLKSZ;
+			result[pos].bytesToRecover =
+				std::min(result[pos].bytesToRecover, subtreeB);
+		}
+	}
+
+	std::vector<PurgeCandidate> collapsed;
+	collapsed.reserve(result.size());
+	for (size_t i = 0; i < result.size(); ++i) {
+		if (!absorbed[i]) {
+			collapsed.push_back(std::move(result[i]));
+		}
+	}
+
+	return collapsed;
+}
+
+bool parseDurationOption(const std::string &value,
+						 std::chrono::milliseconds &result) {
+	size_t pos = 0;
+	long long count;
+	try {
+		count = std::stoll(value, &pos);
+	} catch (const std::exception &) {
+		return false;
+	}
+	if (count < 0) {
+		return false;
+	}
+
+	std::string unit = value.substr(pos);
+	if (unit == "ms") {
+		result = std::chrono::milliseconds(count);
+	} else if (unit.empty() || unit == "s") {
+		result = std::chrono::seconds(count);
+	} else if (unit == "m") {
+		result = std::chrono::minutes(count);
+	} else if (unit == "h") {
+		result = std::chrono::hours(count);
+	} else if (unit == "d") {
+		result = std::chrono::hours(24 * count);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+bool parseSizeOption(const std::string &value, long long &result) {
+	size_t pos = 0;
+	long long count;
+	try {
+		count = std::stoll(value, &pos);
+	} catch (const std::exception &) {
+		return false;
+	}
+	if (count < 0) {
+		return false;
+	}
+
+	std::string unit = value.substr(pos);
+	if (unit.size() > 1) {
+		return false;
+	}
+	switch (unit.empty() ? '\0' : std::tolower(unit[0])) {
+	case '\0':
+		result = count;
+		break;
+	case 'k':
+		result = count << 10;
+		break;
+	case 'm':
+		result = count << 20;
+		break;
+	case 'g':
+		result = count << 30;
+		break;
+	case 't':
+		result = count << 40;
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+uint64_t fingerprint(std::string_view data) {
+	uint64_t hash = 14695981039346656037ull;
+	for (unsigned char c : data) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+void StateWriter::PutU64(uint64_t value) {
+	for (int i = 0; i < 8; ++i) {
+		m_data.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+	}
+}
+
+void StateWriter::PutDouble(double value) {
+	uint64_t bits;
+	static_assert(sizeof(bits) == sizeof(value));
+	std::memcpy(&bits, &value, sizeof(bits));
+	PutU64(bits);
+}
+
+void StateWriter::PutString(std::string_view value) {
+	PutU64(value.size());
+	m_data.append(value);
+}
+
+bool StateReader::GetU64(uint64_t &value) {
+	if (m_data.size() - m_pos < 8) {
+		return false;
+	}
+	value = 0;
+	for (int i = 0; i < 8; ++i) {
+		value |= static_cast<uint64_t>(
+					 static_cast<unsigned char>(m_data[m_pos + i]))
+				 << (8 * i);
+	}
+	m_pos += 8;
+	return true;
+}
+
+bool StateReader::GetI64(int64_t &value) {
+	uint64_t bits;
+	if (!GetU64(bits)) {
+		return false;
+	}
+	value = static_cast<int64_t>(bits);
+	return true;
+}
+
+bool StateReader::GetDouble(double &value) {
+	uint64_t bits;
+	if (!GetU64(bits)) {
+		return false;
+	}
+	std::memcpy(&value, &bits, sizeof(value));
+	return true;
+}
+
+bool StateReader::GetString(std::string &value) {
+	uint64_t size;
+	if (!GetU64(size) || m_data.size() - m_pos < size) {
+		return false;
+	}
+	value.assign(m_data.substr(m_pos, size));
+	m_pos += size;
+	return true;
+}
+
+void PurgeEfficiencyTracker::RecordRequest(const std::string &dir,
+										   const std::string &lotName,
+										   long long requestedB,
+										   long long usageBeforeB) {
+	if (requestedB <= 0) {
+		return;
+	}
+	m_pending[dir] = {lotName, requestedB, usageBeforeB};
+}
+
+void PurgeEfficiencyTracker::Reconcile(
+	const std::function<long long(const std::string &)> &currentUsageB) {
+	// Blend each new observation with the running estimate
+	auto blend = [](std::map<std::string, double> &estimates,
+					const std::string &key, double observed) {
+		auto it = estimates.find(key);
+		if (it == estimates.end()) {
+			estimates[key] = observed;
+		} else {
+			it->second = 0.5 * it->second + 0.5 * observed;
+		}
+	};
+
+	std::map<std::string, std::pair<long long, long long>> lotTotals;
+	for (const auto &[dir, request] : m_pending) {
+		// A directory that didn't shrink was written to at least as fast as
+		// it was purged, if it was purged at all, so it says nothing about
+		// how much the cache frees
+		long long freedB = purgedBytes(request.usageBeforeB, currentUsageB(dir));
+		if (freedB <= 0) {
+			continue;
+		}
+
+		double observed = static_cast<double>(freedB) /
+						  static_cast<double>(request.requestedB);
+		observed = std::clamp(observed, kMinEfficiency, kMaxEfficiency);
+		blend(m_dir_efficiency, dir, observed);
+
+		auto &[lotFreedB, lotRequestedB] = lotTotals[request.lotName];
+		lotFreedB += freedB;
+		lotRequestedB += request.requestedB;
+	}
+
+	for (const auto &[lotName, totals] : lotTotals) {
+		double observed = static_cast<double>(totals.first) /
+						  static_cast<double>(totals.second);
+		observed = std::clamp(observed, kMinEfficiency, kMaxEfficiency);
+		blend(m_lot_efficiency, lotName, observed);
+	}
+
+	m_pending.clear();
+}
+
+double PurgeEfficiencyTracker::GetEfficiency(const std::string &dir,
+											 const std::string &lotName) const {
+	if (auto it = m_dir_efficiency.find(dir); it != m_dir_efficiency.end()) {
+		return it->second;
+	}
+	if (auto it = m_lot_efficiency.find(lotName);
+		it != m_lot_efficiency.end()) {
+		return it->second;
+	}
+	return 1.0;
+}
+
+long long PurgeEfficiencyTracker::AdjustRequest(const std::string &dir,
+												const std::string &lotName,
+												long long targetB,
+												long long dirUsageB) const {
+	double efficiency = GetEfficiency(dir, lotName);
+	long long adjustedB = static_cast<long long>(
+		std::ceil(static_cast<double>(targetB) / efficiency));
+	return std::min(adjustedB, std::max(dirUsageB, targetB));
+}
+
+void PurgeEfficiencyTracker::Save(StateWriter &writer) const {
+	writer.PutU64(m_pending.size());
+	for (const auto &[dir, request] : m_pending) {
+		writer.PutString(dir);
+		writer.PutString(request.lotName);
+		writer.PutI64(request.requestedB);
+		writer.PutI64(request.usageBeforeB);
+	}
+	for (const auto *estimates : {&m_dir_efficiency, &m_lot_efficiency}) {
+		writer.PutU64(estimates->size());
+		for (const auto &[key, efficiency] : *estimates) {
+			writer.PutString(key);
+			writer.PutDouble(efficiency);
+		}
+	}
+}
+
+bool PurgeEfficiencyTracker::Load(StateReader &reader) {
+	std::map<std::string, RequestRecord> pending;
+	uint64_t count;
+	if (!reader.GetU64(count)) {
+		return false;
+	}
+	for (uint64_t i = 0; i < count; ++i) {
+		std::string dir;
+		RequestRecord request;
+		int64_t requestedB, usageBeforeB;
+		if (!reader.GetString(dir) || !reader.GetString(request.lotName) ||
+			!reader.GetI64(requestedB) || !reader.GetI64(usageBeforeB)) {
+			return false;
+		}
+		request.requestedB = requestedB;
+		request.usageBeforeB = usageBeforeB;
+		pending[dir] = request;
+	}
+
+	std::map<std::string, double> dirEfficiency, lotEfficiency;
+	for (auto *estimates : {&dirEfficiency, &lotEfficiency}) {
+		if (!reader.GetU64(count)) {
+			return false;
+		}
+		for (uint64_t i = 0; i < count; ++i) {
+			std::string key;
+			double efficiency;
+			if (!reader.GetString(key) || !reader.GetDouble(efficiency)) {
+				return false;
+			}
+			(*estimates)[key] =
+				std::clamp(efficiency, kMinEfficiency, kMaxEfficiency);
+		}
+	}
+
+	m_pending = std::move(pending);
+	m_dir_efficiency = std::move(dirEfficiency);
+	m_lot_efficiency = std::move(lotEfficiency);
+	return true;
+}
+
+long long purgedBytes(long long usageBeforeB, long long usageNowB) {
+	if (usageNowB < 0) {
+		return usageBeforeB;
+	}
+	return std::max(usageBeforeB - usageNowB, 0ll);
+}
+
+void UsageTrend::RecordPurgeRequest(const std::string &dir, long long usageB) {
+	m_pending_purges[dir] = usageB;
+}
+
+long long UsageTrend::ReconcilePurges(
+	const std::function<long long(const std::string &)> &currentUsageB) {
+	long long purgedB = 0;
+	for (const auto &[dir, usageBeforeB] : m_pending_purges) {
+		purgedB += purgedBytes(usageBeforeB, currentUsageB(dir));
+	}
+	m_pending_purges.clear();
+	m_purged_b += purgedB;
+	return purgedB;
+}
+
+void UsageTrend::AddSample(time_t when, long long usageB) {
+	// A clock that went backwards would make the fit meaningless, so start
+	// over from this sample.
+	if (!m_samples.empty() && when < m_samples.back().first) {
+		Clear();
+	}
+	m_samples.emplace_back(when, usageB + m_purged_b);
+	while (m_samples.size() > m_max_samples) {
+		m_samples.pop_front();
+	}
+}
+
+void UsageTrend::Clear() {
+	m_samples.clear();
+	m_purged_b = 0;
+	m_pending_purges.clear();
+}
+
+double UsageTrend::GetFillRateBps() const {
+	if (m_samples.size() < 2) {
+		return 0.0;
+	}
+
+	// Work relative to the first sample to keep the sums small
+	const double t0 = static_cast<double>(m_samples.front().first);
+	const double u0 = static_cast<double>(m_samples.front().second);
+	double sumT = 0, sumU = 0, sumTT = 0, sumTU = 0;
+	for (const auto &[when, usage] : m_samples) {
+		double t = static_cast<double>(when) - t0;
+		double u = static_cast<double>(usage) - u0;
+		sumT += t;
+		sumU += u;
+		sumTT += t * t;
+		sumTU += t * u;
+	}
+
+	const double n = static_cast<double>(m_samples.size());
+	const double denom = n * sumTT - sumT * sumT;
+	if (denom <= 0) {
+		// All samples share a timestamp
+		return 0.0;
+	}
+
+	return (n * sumTU - sumT * sumU) / denom;
+}
+
+long long UsageTrend::ProjectUsageB(long long seconds) const {
+	if (m_samples.empty()) {
+		return 0;
+	}
+
+	long long lastUsage = m_samples.back().second - m_purged_b;
+	double growth = GetFillRateBps() * static_cast<double>(seconds);
+	return lastUsage + std::llround(growth);
+}
+
+void UsageTrend::Save(StateWriter &writer) const {
+	writer.PutI64(m_purged_b);
+	writer.PutU64(m_samples.size());
+	for (const auto &[when, usage] : m_samples) {
+		writer.PutI64(when);
+		writer.PutI64(usage);
+	}
+	writer.PutU64(m_pending_purges.size());
+	for (const auto &[dir, usageB] : m_pending_purges) {
+		writer.PutString(dir);
+		writer.PutI64(usageB);
+	}
+}
+
+bool UsageTrend::Load(StateReader &reader) {
+	int64_t purgedB;
+	uint64_t count;
+	if (!reader.GetI64(purgedB) || !reader.GetU64(count)) {
+		return false;
+	}
+	std::deque<std::pair<time_t, long long>> samples;
+	for (uint64_t i = 0; i < count; ++i) {
+		int64_t when, usage;
+		if (!reader.GetI64(when) || !reader.GetI64(usage)) {
+			return false;
+		}
+		samples.emplace_back(when, usage);
+	}
+	while (samples.size() > m_max_samples) {
+		samples.pop_front();
+	}
+	std::map<std::string, long long> pendingPurges;
+	if (!reader.GetU64(count)) {
+		return false;
+	}
+	for (uint64_t i = 0; i < count; ++i) {
+		std::string dir;
+		int64_t usageB;
+		if (!reader.GetString(dir) || !reader.GetI64(usageB)) {
+			return false;
+		}
+		pendingPurges[dir] = usageB;
+	}
+
+	m_purged_b = purgedB;
+	m_samples = std::move(samples);
+	m_pending_purges = std::move(pendingPurges);
+	return true;
+}
+
+XrdPurgeLotMan::XrdPurgeLotMan()
+	: log(XrdPfc::Cache::GetInstance().GetLog()), m_purge_dirs{},
+	  m_log{log} {}
+
+XrdPurgeLotMan::~XrdPurgeLotMan() { waitForUsageSync(); }
+
+long long XrdPurgeLotMan::GetConfiguredHWM() { return conf.m_diskUsageHWM; }
+
+long long XrdPurgeLotMan::GetConfiguredLWM() { return conf.m_diskUsageLWM; }
+
+long long XrdPurgeLotMan::GetConfiguredFUsageBaseline() {
+	return conf.m_fileUsageBaseline;
+}
+
+long long XrdPurgeLotMan::GetConfiguredFUsageNominal() {
+	return conf.m_fileUsageNominal;
+}
+
+long long XrdPurgeLotMan::GetConfiguredFUsageMax() {
+	return conf.m_fileUsageMax;
+}
+
+long long XrdPurgeLotMan::GetConfiguredPurgeInterval() {
+	return conf.m_purgeInterval;
+}
+
+time_t XrdPurgeLotMan::GetCurrentTime() { return time(nullptr); }
+
+void XrdPurgeLotMan::startCycleDeadline() {
+	m_cycle_truncated = false;
+	m_cycle_deadline =
+		std::chrono::steady_clock::now() + m_lotman_conf.GetDeadline();
+}
+
+bool XrdPurgeLotMan::deadlineExpired() {
+	if (m_cycle_truncated) {
+		return true;
+	}
+	if (m_lotman_conf.GetDeadline().count() == 0 ||
+		std::chrono::steady_clock::now() < m_cycle_deadline) {
+		return false;
+	}
+
+	m_cycle_truncated = true;
+	m_log.Log(LogLevel::Warning, "deadlineExpired",
+			  "Purge cycle exceeded its deadline of ",
+			  m_lotman_conf.GetDeadline().count(),
+			  "ms, skipping any remaining policy evaluation");
+	return true;
+}
+
+const std::vector<XrdPurgeLotMan::PolicyStageType> &
+XrdPurgeLotMan::getPolicyStageTypes() {
+	static const std::vector<PolicyStageType> stageTypes = {
+		{"del", PurgePolicy::PastDel, &XrdPurgeLotMan::lotsPastDelPolicy,
+		 true},
+		{"exp", PurgePolicy::PastExp, &XrdPurgeLotMan::lotsPastExpPolicy,
+		 true},
+		{"opp", PurgePolicy::PastOpp, &XrdPurgeLotMan::lotsPastOppPolicy,
+		 true},
+		{"ded", PurgePolicy::PastDed, &XrdPurgeLotMan::lotsPastDedPolicy,
+		 false},
+		{"obj", PurgePolicy::PastObj, &XrdPurgeLotMan::lotsPastObjPolicy,
+		 false},
+		{"lru", PurgePolicy::SizeOrderedLRU,
+		 &XrdPurgeLotMan::sizeOrderedLRUPolicy, false}};
+	return stageTypes;
+}
+
+XrdPurgeLotMan::PolicyStage
+XrdPurgeLotMan::makePolicyStage(PurgePolicy policy,
+								const PolicyStageParams &params) {
+	for (const auto &type : getPolicyStageTypes()) {
+		if (type.policy == policy) {
+			return {policy, params, type.run, type.configName, type.light};
+		}
+	}
+	return {PurgePolicy::UnknownPolicy, params, nullptr};
+}
+
+void XrdPurgeLotMan::applyPolicies(const DataFsPurgeshot &purge_shot,
+								   long long &bytesRemaining, bool lightOnly) {
+	// Every shard runs a stage before any shard moves on to the next one, so
+	// candidates are merged in policy order no matter which shard they're
+	// from. The shard that goes first changes every cycle.
+	const size_t firstShard = m_shard_rotation++ % m_shards.size();
+	for (const auto &stage : m_lotman_conf.GetPipeline()) {
+		if (bytesRemaining <= 0 || deadlineExpired()) {
+			break;
+		}
+		if (lightOnly && !stage.light) {
+			continue;
+		}
+
+		// A stage with a budget only gets to claim up to that many bytes,
+		// leaving the rest for later stages.
+		long long stageRemaining = bytesRemaining;
+		if (stage.params.budgetB > 0) {
+			stageRemaining = std::min(stageRemaining, stage.params.budgetB);
+		}
+		const long long stageStart = stageRemaining;
+		for (size_t i = 0; i < m_shards.size(); ++i) {
+			if (stageRemaining <= 0 || deadlineExpired()) {
+				break;
+			}
+			if (!activateShard((firstShard + i) % m_shards.size())) {
+				continue;
+			}
+			const char *lotHome = activeShard().lotHome.c_str();
+			const long long shardStart = stageRemaining;
+			XRDLOTMAN_PROBE(stage_start, stage.configName, lotHome,
+							shardStart);
+			const auto start = XRDLOTMAN_PROBE_START(stage_done);
+			(this->*stage.run)(purge_shot, stageRemaining, stage.params);
+			if (XRDLOTMAN_PROBE_ENABLED(stage_done)) {
+				XRDLOTMAN_PROBE(stage_done, stage.configName, lotHome,
+								shardStart - stageRemaining,
+								nanosecondsSince(start));
+			}
+		}
+		bytesRemaining -= stageStart - stageRemaining;
+	}
+}
+
+bool XrdPurgeLotMan::activateShard(size_t idx) {
+	if (idx == m_active_shard) {
+		return true;
+	}
+
+	const std::string &lotHome = m_shards[idx].lotHome;
+	char *err;
+	auto rv = XRDLOTMAN_CALL("", lotman_set_context_str, "lot_home",
+							 lotHome.c_str(), &err);
+	if (rv != 0) {
+		m_log.Log(LogLevel::Error, "activateShard",
+				  "Error setting lot home to '", lotHome, "': ", err);
+		return false;
+	}
+	m_active_shard = idx;
+	return true;
+}
+
+size_t XrdPurgeLotMan::findShard(std::string_view topLevelDir) const {
+	for (size_t i = 1; i < m_shards.size(); ++i) {
+		if (m_shards[i].topLevelDir == topLevelDir) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+const DirUsage *XrdPurgeLotMan::findDirUsage(const DataFsPurgeshot &purge_shot,
+											const std::string &path) const {
+	int idx = m_dir_tree.Find(normalizeDirPath(path));
+	return idx == -1 ? nullptr : &purge_shot.m_dir_vec[idx].m_usage;
+}
+
+struct XrdPurgeLotMan::LotDeleter {
+	void operator()(char **ptr) { lotman_free_string_list(ptr); }
+};
+
+// Gets all the root lots and tallies up their usage. Used to construct the
+// total number of bytes to clear on each purge loop by comparing with
+// configured HWM/LWM.
+long long XrdPurgeLotMan::getTotalUsageB() {
+	long long totalUsage = 0;
+	const Shard &shard = activeShard();
+	if (shard.lotUsageValid) {
+		for (const auto &lotName : getRootLots()) {
+			totalUsage += shard.lotUsage.at(lotName).totalB;
+		}
+		return totalUsage;
+	}
+
+	const std::vector<std::string> rootLots = getRootLots();
+	fetchLotUsage(rootLots);
+	for (const auto &lotName : rootLots) {
+		auto it = shard.lotManUsage.find(lotName);
+		if (it != shard.lotManUsage.end()) {
+			totalUsage += it->second.totalB;
+		}
+	}
+
+	return totalUsage;
+}
+
+void XrdPurgeLotMan::fetchLotUsage(const std::vector<std::string> &lots,
+								   bool stopAtDeadline) {
+	Shard &shard = activeShard();
+	json usageQueryJSON;
+	usageQueryJSON["total_GB"] = true;
+	usageQueryJSON["dedicated_GB"] = true;
+	usageQueryJSON["opportunistic_GB"] = true;
+	usageQueryJSON["num_objects"] = true;
+	std::string query;
+	for (const auto &lotName : lots) {
+		if (stopAtDeadline && deadlineExpired()) {
+			return;
+		}
+		if (shard.lotManUsage.count(lotName)) {
+			continue;
+		}
+
+		usageQueryJSON["lot_name"] = lotName;
+		query = usageQueryJSON.dump();
+		char *output;
+		char *err;
+		auto rv = XRDLOTMAN_CALL(lotName.c_str(), lotman_get_lot_usage,
+								 query.c_str(), &output, &err);
+		if (rv != 0) {
+			std::unique_ptr<char, decltype(&free)> err_ptr(err, free);
+			m_log.Log(LogLevel::Error, "fetchLotUsage",
+					  "Error getting lot usage for ", lotName, ": ", err);
+			continue;
+		}
+
+		std::unique_ptr<char, decltype(&free)> output_ptr(output, free);
+		json usageJSON = json::parse(output_ptr.get());
+		// Convert each of LotMan's numbers to bytes before doing any math on
+		// them
+		LotManUsage &usage = shard.lotManUsage[lotName];
+		usage.totalB = gbToBytes(usageJSON["total_GB"]["total"]);
+		usage.dedicatedB = gbToBytes(usageJSON["dedicated_GB"]["total"]);
+		usage.opportunisticB =
+			gbToBytes(usageJSON["opportunistic_GB"]["total"]);
+		usage.numObjects = usageJSON["num_objects"]["total"];
+	}
+}
+
+const LotManUsage *XrdPurgeLotMan::getLotManUsage(const std::string &lot) {
+	const Shard &shard = activeShard();
+	auto it = shard.lotManUsage.find(lot);
+	if (it == shard.lotManUsage.end()) {
+		fetchLotUsage({lot});
+		it = shard.lotManUsage.find(lot);
+	}
+	return it == shard.lotManUsage.end() ? nullptr : &it->second;
+}
+
+std::vector<std::string> XrdPurgeLotMan::getRootLots() {
+	std::vector<std::string> rootLots;
+	if (const Shard &shard = activeShard(); shard.lotCacheLoaded) {
+		for (const auto &[lotName, info] : shard.lotCache) {
+			if (info.isRoot) {
+				rootLots.push_back(lotName);
+			}
+		}
+		return rootLots;
+	}
+
+	// Get all lots, and keep those that are rootly
+	char **rawLots = nullptr;
+	char *err;
+	auto rv = XRDLOTMAN_CALL("", lotman_list_all_lots, &rawLots, &err);
+	std::unique_ptr<char *[], LotDeleter> lots(rawLots, LotDeleter());
+	if (rv != 0) {
+		m_log.Log(LogLevel::Error, "getRootLots", "Error getting all lots: ",
+				  err);
+		return rootLots;
+	}
+
+	for (int i = 0; lots[i] != nullptr; ++i) {
+		std::string lotName = lots[i];
+		// Check if the lot is a root lot
+		if (int rc = XRDLOTMAN_CALL(lotName.c_str(), lotman_is_root,
+									lotName.c_str(), &err);
+			rc != 1) {
+			// Not root, or an error
+			if (rc < 0) {
+				m_log.Log(LogLevel::Error, "getRootLots",
+						  "Error checking if lot '", lotName, "' is root: ",
+						  err);
+			}
+			continue;
+		}
+		rootLots.push_back(lotName);
+	}
+
+	return rootLots;
+}
+
+bool XrdPurgeLotMan::loadLotCache() {
+	char **rawLots = nullptr;
+	char *err;
+	auto rv = XRDLOTMAN_CALL("", lotman_list_all_lots, &rawLots, &err);
+	std::unique_ptr<char *[], LotDeleter> lots(rawLots, LotDeleter());
+	if (rv != 0) {
+		m_log.Log(LogLevel::Error, "loadLotCache", "Error getting all lots: ",
+				  err);
+		return false;
+	}
+
+	std::map<std::string, LotInfo> lotCache;
+	size_t numPaths = 0;
+	try {
+		for (int i = 0; lots[i] != nullptr; ++i) {
+			const std::string lotName = lots[i];
+			LotInfo &info = lotCache[lotName];
+
+			int rc = XRDLOTMAN_CALL(lotName.c_str(), lotman_is_root,
+									lotName.c_str(), &err);
+			if (rc < 0) {
+				throw std::runtime_error("could not check if lot '" + lotName +
+										 "' is root: " + std::string(err));
+			}
+			info.isRoot = rc == 1;
+
+			char **rawParents = nullptr;
+			rv = XRDLOTMAN_CALL(lotName.c_str(), lotman_get_parent_names,
+								lotName.c_str(), false, false, &rawParents,
+								&err);
+			std::unique_ptr<char *[], LotDeleter> parents(rawParents,
+														  LotDeleter());
+			if (rv != 0) {
+				throw std::runtime_error("could not get parents of lot '" +
+										 lotName + "': " + std::string(err));
+			}
+			for (int j = 0; parents[j] != nullptr; ++j) {
+				info.parents.push_back(parents[j]);
+			}
+
+			// Only the lot's own paths. Paths of its children are found
+			// through the hierarchy when they're needed.
+			char *dirs;
+			rv = XRDLOTMAN_CALL(lotName.c_str(), lotman_get_lot_dirs,
+								lotName.c_str(), false, &dirs, &err);
+			if (rv != 0) {
+				throw std::runtime_error("could not get dirs in lot '" +
+										 lotName + "': " + std::string(err));
+			}
+			std::unique_ptr<char, decltype(&free)> dirs_ptr(dirs, free);
+			for (const auto &dir : json::parse(dirs_ptr.get())) {
+				info.paths.emplace_back(
+					normalizeDirPath(dir["path"].get<std::string>()),
+					dir.value("recursive", true));
+			}
+			numPaths += info.paths.size();
+
+			json attrQueryJSON;
+			attrQueryJSON["lot_name"] = lotName;
+			attrQueryJSON["dedicated_GB"] = true;
+			attrQueryJSON["opportunistic_GB"] = true;
+			attrQueryJSON["max_num_objects"] = true;
+			char *output;
+			rv = XRDLOTMAN_CALL(lotName.c_str(), lotman_get_policy_attributes,
+								attrQueryJSON.dump().c_str(), &output, &err);
+			if (rv != 0) {
+				throw std::runtime_error("could not get quotas of lot '" +
+										 lotName + "': " + std::string(err));
+			}
+			std::unique_ptr<char, decltype(&free)> output_ptr(output, free);
+			json attrJSON = json::parse(output_ptr.get());
+			info.dedicatedB = gbToBytes(attrJSON["dedicated_GB"]["value"]);
+			info.opportunisticB =
+				gbToBytes(attrJSON["opportunistic_GB"]["value"]);
+			info.maxObjects = attrJSON["max_num_objects"]["value"];
+		}
+	} catch (const std::exception &e) {
+		m_log.Log(LogLevel::Error, "loadLotCache",
+				  "Error loading lots from LotMan: ", e.what());
+		return false;
+	}
+
+	for (auto &[lotName, info] : lotCache) {
+		for (const auto &parent : info.parents) {
+			auto it = lotCache.find(parent);
+			if (it != lotCache.end() && parent != lotName) {
+				it->second.children.push_back(lotName);
+			}
+		}
+	}
+
+	m_log.Log(LogLevel::Info, "loadLotCache", "Loaded ", lotCache.size(),
+			  " lots with ", numPaths, " paths from LotMan");
+
+	Shard &shard = activeShard();
+	shard.lotCache = std::move(lotCache);
+	shard.lotCacheLoaded = true;
+	shard.lotCacheLoadedAt = std::chrono::steady_clock::now();
+	shard.lotDirIndexBuilt = false;
+	return true;
+}
+
+void XrdPurgeLotMan::refreshLotCache() {
+	const Shard &shard = activeShard();
+	auto age = std::chrono::steady_clock::now() - shard.lotCacheLoadedAt;
+	if (shard.lotCacheLoaded && age < m_lotman_conf.GetLotCacheTTL()) {
+		return;
+	}
+	loadLotCache();
+}
+
+std::vector<std::string> XrdPurgeLotMan::getLotDirs(const std::string &lot) {
+	std::vector<std::string> lotDirs;
+	const Shard &shard = activeShard();
+	auto lotIt = shard.lotCache.find(lot);
+	if (!shard.lotCacheLoaded || lotIt == shard.lotCache.end()) {
+		// Possibly a lot that was created since the cache was loaded
+		char *dirs; // will hold a JSON list of lot usage objects
+		char *err;
+		auto rv = XRDLOTMAN_CALL(lot.c_str(), lotman_get_lot_dirs,
+								 lot.c_str(), true, &dirs, &err);
+		if (rv != 0) {
+			m_log.Log(LogLevel::Error, "getLotDirs",
+					  "Error getting dirs in lot ", lot, ": ", err);
+			return lotDirs;
+		}
+
+		std::unique_ptr<char, decltype(&free)> dirs_ptr(dirs, free);
+		for (const auto &dir : json::parse(dirs_ptr.get())) {
+			lotDirs.push_back(dir["path"]);
+		}
+		return lotDirs;
+	}
+
+	// Gather the lot's own paths, then those of all its descendants
+	std::vector<const std::string *> toVisit = {&lotIt->first};
+	std::unordered_set<std::string> visited;
+	while (!toVisit.empty()) {
+		const std::string &lotName = *toVisit.back();
+		toVisit.pop_back();
+		auto it = shard.lotCache.find(lotName);
+		if (it == shard.lotCache.end() || !visited.insert(lotName).second) {
+			continue;
+		}
+		for (const auto &path : it->second.paths) {
+			lotDirs.push_back(path.first);
+		}
+		for (const auto &child : it->second.children) {
+			toVisit.push_back(&child);
+		}
+	}
+
+	return lotDirs;
+}
+
+void XrdPurgeLotMan::invalidateLotCandidates(
+	const std::unordered_set<std::string> &lots) {
+	// A lot's candidates include its descendants' directories, so every lot
+	// above a changed one is affected too
+	Shard &shard = activeShard();
+	std::vector<std::string> toVisit(lots.begin(), lots.end());
+	std::unordered_set<std::string> visited;
+	while (!toVisit.empty()) {
+		std::string lotName = std::move(toVisit.back());
+		toVisit.pop_back();
+		if (!visited.insert(lotName).second) {
+			continue;
+		}
+		if (auto it = shard.lotCandidates.find(lotName);
+			it != shard.lotCandidates.end()) {
+			it->second.valid = false;
+		}
+		if (auto it = shard.lotCache.find(lotName);
+			it != shard.lotCache.end()) {
+			toVisit.insert(toVisit.end(), it->second.parents.begin(),
+						   it->second.parents.end());
+		}
+	}
+}
+
+// Given a lot name, get its associated directories and deduce their usage from
+// the purge_shot's statistics. Bytes under another lot's directory are left to
+// that directory, so policies walking parent and child lots don't claim them
+// twice. The result only depends on the directories of the lot and its
+// descendants, so it's reused until one of them changes.
+const std::map<std::string, long long> &
+XrdPurgeLotMan::lotPerDirUsageB(const std::string &lot,
+								const DataFsPurgeshot &purge_shot) {
+	Shard &shard = activeShard();
+	LotCandidates &candidates = shard.lotCandidates[lot];
+	if (candidates.valid) {
+		++m_candidates_reused;
+		return candidates.dirs;
+	}
+	++m_candidates_computed;
+
+	std::map<std::string, long long> &usageMap = candidates.dirs;
+	usageMap.clear();
+	for (const auto &path : getLotDirs(lot)) {
+		if (const auto *entry =
+				shard.lotDirIndex.Find(normalizeDirPath(path))) {
+			usageMap[path] = entry->exclusiveB;
+			continue;
+		}
+
+		// Get the usage for the directory
+		const DirUsage *dirUsage = findDirUsage(purge_shot, path);
+		if (dirUsage == nullptr) {
+			m_log.Log(LogLevel::Error, "lotPerDirUsageB",
+					  "Error finding usage for directory ", path);
+			continue;
+		}
+		long long bytesToRecover =
+			static_cast<long long>(dirUsage->m_StBlocks) * BLKSZ;
+		usageMap[path] = bytesToRecover;
+	}
+
+	// Only the lots in the cache are kept up to date by the lot directory
+	// index
+	candidates.valid = shard.lotDirIndexBuilt && shard.lotCache.count(lot);
+	return usageMap;
+}
+
+/*
+A set of policy wrappers that call the appropriate underlying type of policy
+function, which can either entail a total purge policy (for things like
+deletable/expired lots) or partial purge (for lots past dedicated/opportunistic
+quotas).
+*/
+void XrdPurgeLotMan::lotsPastDelPolicy(const DataFsPurgeshot &purgeShot,
+									   long long &bytesRemaining,
+									   const PolicyStageParams &) {
+	PurgePolicy policy = PurgePolicy::PastDel;
+	completePurgePolicyBase(purgeShot, bytesRemaining, policy);
+}
+
+void XrdPurgeLotMan::lotsPastExpPolicy(const DataFsPurgeshot &purgeShot,
+									   long long &bytesRemaining,
+									   const PolicyStageParams &) {
+	PurgePolicy policy = PurgePolicy::PastExp;
+	completePurgePolicyBase(purgeShot, bytesRemaining, policy);
+}
+
+void XrdPurgeLotMan::lotsPastOppPolicy(const DataFsPurgeshot &purgeShot,
+									   long long &bytesRemaining,
+									   const PolicyStageParams &) {
+	PurgePolicy policy = PurgePolicy::PastOpp;
+	partialPurgePolicyBase(purgeShot, bytesRemaining, policy);
+}
+
+void XrdPurgeLotMan::lotsPastDedPolicy(const DataFsPurgeshot &purgeShot,
+									   long long &bytesRemaining,
+									   const PolicyStageParams &) {
+	PurgePolicy policy = PurgePolicy::PastDed;
+	partialPurgePolicyBase(purgeShot, bytesRemaining, policy);
+}
+
+void XrdPurgeLotMan::lotsPastObjPolicy(const DataFsPurgeshot &purgeShot,
+									   long long &bytesRemaining,
+									   const PolicyStageParams &) {
+	PurgePolicy policy = PurgePolicy::PastObj;
+	partialPurgePolicyBase(purgeShot, bytesRemaining, policy);
+}
+
+/*
+END POLICY WRAPPERS
+*/
+
+// Claim up to maxB bytes from a directory, taking into account whatever other
+// policies may have already claimed from it.
+long long XrdPurgeLotMan::claimDirBytes(const std::string &dir,
+										const std::string &lotName,
+										long long bytesInDir, long long maxB) {
+	auto it = m_purge_dirs.find(dir);
+	if (it == m_purge_dirs.end()) {
+		// First time any policy has hit this dir, record it
+		it = m_purge_dirs
+				 .emplace(dir, std::make_unique<PurgeDirCandidateStats>(
+								   0ll, bytesInDir, lotName))
+				 .first;
+	}
+
+	PurgeDirCandidateStats &stats = *it->second;
+	long long toRecoverFromDir = std::min(stats.dir_b_remaining, maxB);
+	if (toRecoverFromDir <= 0) {
+		// There's nothing left to clean up in this directory
+		return 0;
+	}
+
+	stats.dir_b_to_purge += toRecoverFromDir;
+	stats.dir_b_remaining -= toRecoverFromDir;
+	XRDLOTMAN_PROBE(dir_claim, lotName.c_str(), dir.c_str(), toRecoverFromDir);
+	return toRecoverFromDir;
+}
+
+// Look up a lot's object quota, or -1 if it can't be determined
+long long XrdPurgeLotMan::getLotMaxObjects(const std::string &lot) {
+	const auto &lotCache = activeShard().lotCache;
+	if (auto it = lotCache.find(lot); it != lotCache.end()) {
+		return it->second.maxObjects;
+	}
+
+	json attrQueryJSON;
+	attrQueryJSON["lot_name"] = lot;
+	attrQueryJSON["max_num_objects"] = true;
+
+	char *output;
+	char *err;
+	auto rv = XRDLOTMAN_CALL(lot.c_str(), lotman_get_policy_attributes,
+							 attrQueryJSON.dump().c_str(), &output, &err);
+	if (rv != 0) {
+		std::unique_ptr<char, decltype(&free)> err_ptr(err, free);
+		m_log.Log(LogLevel::Error, "getLotMaxObjects",
+				  "Error getting object quota for lot ", lot, ": ", err);
+		return -1;
+	}
+
+	std::unique_ptr<char, decltype(&free)> output_ptr(output, free);
+	json attrJSON = json::parse(output_ptr.get());
+	return attrJSON["max_num_objects"]["value"];
+}
+
+void XrdPurgeLotMan::sizeOrderedLRUPolicy(const DataFsPurgeshot &purgeShot,
+										  long long &globalBRemaining,
+										  const PolicyStageParams &params) {
+	std::vector<std::string> lotNames;
+	if (const Shard &shard = activeShard(); shard.lotCacheLoaded) {
+		for (const auto &entry : shard.lotCache) {
+			lotNames.push_back(entry.first);
+		}
+	} else {
+		char **rawLots = nullptr;
+		char *err;
+		auto rv = XRDLOTMAN_CALL("", lotman_list_all_lots, &rawLots, &err);
+		std::unique_ptr<char *[], LotDeleter> lots(rawLots, LotDeleter());
+		if (rv != 0) {
+			m_log.Log(LogLevel::Error, "sizeOrderedLRUPolicy",
+					  "Error getting all lots: ", err);
+			return;
+		}
+		for (int i = 0; lots[i] != nullptr; ++i) {
+			lotNames.push_back(lots[i]);
+		}
+	}
+
+	struct LRUCandidate {
+		std::string dir;
+		std::string lotName;
+		long long bytesInDir;
+		time_t lastAccess;
+	};
+
+	// Gather every directory tied to a lot that's been idle long enough
+	const time_t now = time(nullptr);
+	std::vector<LRUCandidate> candidates;
+	std::unordered_set<std::string> seen;
+	for (const auto &lotName : lotNames) {
+		if (deadlineExpired()) {
+			return;
+		}
+
+		for (const auto &[dir, bytesInDir] :
+			 lotPerDirUsageB(lotName, purgeShot)) {
+			if (bytesInDir <= 0 || !seen.insert(dir).second) {
+				continue;
+			}
+
+			// Candidates may be keyed by a lot's raw path, which the purge
+			// shot might not know under that name
+			const DirUsage *usage = findDirUsage(purgeShot, dir);
+			if (usage == nullptr) {
+				continue;
+			}
+			time_t lastAccess =
+				std::max(usage->m_LastOpenTime, usage->m_LastCloseTime);
+			if (now - lastAccess < params.minAge.count()) {
+				continue;
+			}
+			candidates.push_back({dir, lotName, bytesInDir, lastAccess});
+		}
+	}
+
+	// Oldest first, and among equally old directories the largest first
+	std::sort(candidates.begin(), candidates.end(),
+			  [](const LRUCandidate &a, const LRUCandidate &b) {
+				  if (a.lastAccess != b.lastAccess) {
+					  return a.lastAccess < b.lastAccess;
+				  }
+				  return a.bytesInDir > b.bytesInDir;
+			  });
+
+	for (const auto &candidate : candidates) {
+		if (globalBRemaining <= 0) {
+			break;
+		}
+		globalBRemaining -=
+			claimDirBytes(candidate.dir, candidate.lotName,
+						  candidate.bytesInDir, globalBRemaining);
+	}
+}
+
+// Scaffolding for policies that require purging the entire lot
+void XrdPurgeLotMan::completePurgePolicyBase(const DataFsPurgeshot &purgeShot,
+											 long long &globalBRemaining,
+											 XrdPfc::PurgePolicy policy) {
+	char **lots;
+	char *err;
+	int rv{-1};
+
+	switch (policy) {
+	case XrdPfc::PurgePolicy::PastDel:
+		rv = XRDLOTMAN_CALL("", lotman_get_lots_past_del, true, &lots, &err);
+		break;
+	case XrdPfc::PurgePolicy::PastExp:
+		rv = XRDLOTMAN_CALL("", lotman_get_lots_past_exp, true, &lots, &err);
+		break;
+	default:
+		m_log.Log(LogLevel::Error, "completePurgePolicyBase",
+				  "Unexpected purge policy: ", policy);
+		return;
+	}
+	std::unique_ptr<char *[], LotDeleter> lots_total_purge(lots, LotDeleter());
+	if (rv != 0) {
+		m_log.Log(LogLevel::Error, "completePurgePolicyBase",
+				  "Error getting lots for policy ", policy, ": ", err);
+		return;
+	}
+	m_log.Log(LogLevel::Info, "completePurgePolicyBase", "Purge policy ",
+			  policy, " requires clearing lots: ", LogList{lots});
+
+	// While there's still global space to clear, get directory usage
+	// for each of the directories tied to each lot
+	for (int i = 0; lots[i] != nullptr; ++i) {
+		if (globalBRemaining == 0 || deadlineExpired()) {
+			break;
+		}
+
+		const std::string lotName = lots[i];
+
+		// For each directory tied to a lot, get the usage and cumulatively
+		// track how much space we need to clear. This also takes into account
+		// other policies that may have already started aggregating space to
+		// clear from that directory as well.
+		const std::map<std::string, long long> &tmpMap =
+			lotPerDirUsageB(lotName, purgeShot);
+		for (const auto &[dir, bytesInDir] : tmpMap) {
+			if (globalBRemaining <= 0) {
+				break;
+			}
+
+			// Clean out the rest of the dir, unless we don't have that much
+			// left to clear
+			globalBRemaining -=
+				claimDirBytes(dir, lotName, bytesInDir, globalBRemaining);
+		}
+	}
+
+	return;
+}
+
+// Scaffolding for policies that require purging partial lots
+void XrdPurgeLotMan::partialPurgePolicyBase(const DataFsPurgeshot &purgeShot,
+											long long &globalBRemaining,
+											XrdPfc::PurgePolicy policy) {
+	if (policy != XrdPfc::PurgePolicy::PastOpp &&
+		policy != XrdPfc::PurgePolicy::PastDed &&
+		policy != XrdPfc::PurgePolicy::PastObj) {
+		m_log.Log(LogLevel::Error, "partialPurgePolicyBase",
+				  "Unexpected purge policy: ", policy);
+		return;
+	}
+
+	std::vector<std::string> lotNames;
+	if (activeShard().lotUsageValid) {
+		lotNames = getLocalLotsPast(policy);
+		m_log.Log(LogLevel::Info, "partialPurgePolicyBase", "Purge policy ",
+				  policy, " requires clearing lots: ", LogList{{}, &lotNames});
+	} else {
+		char **lots;
+		char *err;
+		// TODO: Come back and think about whether we want recursive children
+		//       here. For now, I'm saying _yes_ because if a child takes up
+		//       lots of space but isn't past its own quota, we still want the
+		//       option to clear it.
+		int rv{-1};
+		switch (policy) {
+		case XrdPfc::PurgePolicy::PastOpp:
+			rv = XRDLOTMAN_CALL("", lotman_get_lots_past_opp, true, true,
+								&lots, &err);
+			break;
+		case XrdPfc::PurgePolicy::PastDed:
+			rv = XRDLOTMAN_CALL("", lotman_get_lots_past_ded, true, true,
+								&lots, &err);
+			break;
+		default:
+			rv = XRDLOTMAN_CALL("", lotman_get_lots_past_obj, true, true,
+								&lots, &err);
+			break;
+		}
+		std::unique_ptr<char *[], LotDeleter> lots_partial_purge(lots,
+																 LotDeleter());
+
+		if (rv != 0) {
+			m_log.Log(LogLevel::Error, "partialPurgePolicyBase",
+					  "Error getting lots for policy ", policy, ": ", err);
+			return;
+		}
+		m_log.Log(LogLevel::Info, "partialPurgePolicyBase", "Purge policy ",
+				  policy, " requires clearing lots: ", LogList{lots});
+		for (int i = 0; lots[i] != nullptr; ++i) {
+			lotNames.emplace_back(lots[i]);
+		}
+		// Fetch their usage before going through them, so it's in the table
+		// for the stages after this one
+		fetchLotUsage(lotNames, true);
+	}
+
+	// Get directory usage for each of the directories tied to each lot
+	for (const auto &lotName : lotNames) {
+		if (globalBRemaining <= 0 || deadlineExpired()) {
+			break;
+		}
+
+		long long toRecoverFromLot = getLotExcessB(lotName, policy);
+		if (toRecoverFromLot > globalBRemaining) {
+			toRecoverFromLot = globalBRemaining;
+		}
+		if (toRecoverFromLot <= 0) {
+			continue;
+		}
+
+		const std::map<std::string, long long> &tmpUsage =
+			lotPerDirUsageB(lotName, purgeShot);
+		for (const auto &[dir, bytesInDir] : tmpUsage) {
+			if (globalBRemaining <= 0 || toRecoverFromLot <= 0) {
+				break;
+			}
+
+			// Get rid of as much of the dir as we need to
+			long long toRecoverFromDir =
+				claimDirBytes(dir, lotName, bytesInDir, toRecoverFromLot);
+			globalBRemaining -= toRecoverFromDir;
+			toRecoverFromLot -= toRecoverFromDir;
+		}
+	}
+
+	return;
+}
+
+std::vector<std::string> XrdPurgeLotMan::getLocalLotsPast(PurgePolicy policy) {
+	const Shard &shard = activeShard();
+	std::vector<std::string> lotsPast;
+	std::unordered_set<std::string> seen;
+	std::function<void(const std::string &)> addWithDescendants =
+		[&](const std::string &lotName) {
+			if (!seen.insert(lotName).second) {
+				return;
+			}
+			lotsPast.push_back(lotName);
+			for (const auto &child : shard.lotCache.at(lotName).children) {
+				if (shard.lotCache.count(child)) {
+					addWithDescendants(child);
+				}
+			}
+		};
+
+	for (const auto &[lotName, info] : shard.lotCache) {
+		if (getLotExcessB(lotName, policy) > 0) {
+			addWithDescendants(lotName);
+		}
+	}
+	return lotsPast;
+}
+
+long long XrdPurgeLotMan::getLotExcessB(const std::string &lotName,
+										PurgePolicy policy) {
+	// if past opp, then toRecover = total_usage - opp_usage - ded_usage
+	// if past ded, then toRecover = total_usage - ded_usage
+	// if past obj, then toRecover is the share of total_usage held by the
+	// objects over the lot's object quota
+	const Shard &shard = activeShard();
+	auto usageIt = shard.lotUsage.find(lotName);
+	auto infoIt = shard.lotCache.find(lotName);
+	if (shard.lotUsageValid && usageIt != shard.lotUsage.end() &&
+		infoIt != shard.lotCache.end()) {
+		const LotUsage &usage = usageIt->second;
+		const LotInfo &info = infoIt->second;
+		if (policy == XrdPfc::PurgePolicy::PastObj) {
+			if (info.maxObjects < 0 || usage.totalObjects <= info.maxObjects) {
+				return -1;
+			}
+			return scaleBytes(usage.totalB,
+							  usage.totalObjects - info.maxObjects,
+							  usage.totalObjects);
+		} else if (policy == XrdPfc::PurgePolicy::PastOpp) {
+			return usage.totalB - info.dedicatedB - info.opportunisticB;
+		}
+		return usage.totalB - info.dedicatedB;
+	}
+
+	const LotManUsage *usage = getLotManUsage(lotName);
+	if (usage == nullptr) {
+		return -1;
+	}
+	if (policy == XrdPfc::PurgePolicy::PastObj) {
+		long long maxObjects = getLotMaxObjects(lotName);
+		if (maxObjects < 0 || usage->numObjects <= maxObjects) {
+			return -1;
+		}
+		return scaleBytes(usage->totalB, usage->numObjects - maxObjects,
+						  usage->numObjects);
+	} else if (policy == XrdPfc::PurgePolicy::PastOpp) {
+		return usage->totalB - usage->dedicatedB - usage->opportunisticB;
+	}
+	return usage->totalB - usage->dedicatedB;
+}
+
+// Purge only what's needed to keep the projected usage at the next purge cycle
+// under the max. This spreads the purge I/O over several smaller cycles instead
+// of waiting for the max to be crossed and then clearing down to the baseline
+// all at once.
+long long
+XrdPurgeLotMan::getPredictedBytesToRecover(long long totalUsageB,
+										   long long HWMComparator,
+										   long long LWMComparator) {
+	if (m_usage_trend.GetFillRateBps() <= 0) {
+		return 0;
+	}
+
+	long long projectedUsageB =
+		m_usage_trend.ProjectUsageB(GetConfiguredPurgeInterval());
+	if (projectedUsageB < HWMComparator) {
+		return 0;
+	}
+
+	long long bytesToRecover = projectedUsageB - HWMComparator;
+	return std::min(bytesToRecover, totalUsageB - LWMComparator);
+}
+
+/*
+Handles determining the total number of bytes to recover,
+as well as populating the m_list of directories:bytesToRecover the purge cycle
+iterates over when clearing stuff.
+
+In LotMan's ideal case, we could say "here's the ordering of directories, keep
+clearing until you hit LWM," but the purge code doesn't quite have the logic for
+that, so handle this determination in the plugin.
+*/
+long long XrdPurgeLotMan::GetBytesToRecover(const DataFsPurgeshot &purge_shot) {
+	long long bytesToRecover = runPurgeCycle(purge_shot);
+	// Only once the cycle is done, so a what-if sees the same lots and usage.
+	// A cycle that gave up before bringing the usage up to date leaves the
+	// request for the next one.
+	std::error_code ec;
+	if (std::filesystem::exists(getWhatIfPath(), ec)) {
+		if (m_cycle_usage_ready) {
+			runWhatIf(purge_shot);
+		} else {
+			m_log.Log(LogLevel::Warning, "GetBytesToRecover",
+					  "Purge cycle ended before lot usage was up to date, "
+					  "leaving the what-if request for the next one");
+		}
+	}
+	return bytesToRecover;
+}
+
+bool XrdPurgeLotMan::getPurgeLimits(long long &maxB, long long &baselineB,
+									long long &nominalB) {
+	nominalB = -1;
+	// Prefer file usage info, but fall back to HWM/LWM if not available
+	if (GetConfiguredFUsageBaseline() > 0 && GetConfiguredFUsageNominal() > 0 &&
+		GetConfiguredFUsageMax() > 0) {
+		maxB = GetConfiguredFUsageMax();
+		baselineB = GetConfiguredFUsageBaseline();
+		nominalB = GetConfiguredFUsageNominal();
+	} else if (GetConfiguredHWM() > 0 && GetConfiguredLWM() > 0) {
+		maxB = GetConfiguredHWM();
+		baselineB = GetConfiguredLWM();
+	} else {
+		m_log.Log(LogLevel::Error, "getPurgeLimits",
+				  "No valid HWM/LWM or file usage info available. Cannot "
+				  "determine how much to recover.");
+		return false;
+	}
+	return true;
+}
+
+long long XrdPurgeLotMan::runPurgeCycle(const DataFsPurgeshot &purge_shot) {
+	const auto cycleStart = XRDLOTMAN_PROBE_START(cycle_done);
+	// reset m_list
+	m_list.clear();
+	m_purge_dirs.clear();
+	m_candidates_reused = 0;
+	m_candidates_computed = 0;
+	m_cycle_usage_ready = false;
+	startCycleDeadline();
+	// A usage sync still running is reading the old tree
+	waitForUsageSync();
+	m_dir_tree = DirTree(purge_shot);
+
+	// See how much the cache actually freed for last cycle's requests before
+	// deciding on this cycle's
+	auto dirUsageB = [&](const std::string &dir) {
+		const DirUsage *usage = findDirUsage(purge_shot, dir);
+		return usage ? usage->m_StBlocks * BLKSZ : -1ll;
+	};
+	m_usage_trend.ReconcilePurges(dirUsageB);
+	if (m_lotman_conf.GetFeedback()) {
+		m_purge_efficiency.Reconcile(dirUsageB);
+	}
+
+	char *err;
+	char *output;
+	auto rv =
+		XRDLOTMAN_CALL("", lotman_get_context_str, "lot_home", &output, &err);
+	if (rv != 0) {
+		m_log.Log(LogLevel::Error, "GetBytesToRecover",
+				  "Error getting lot home: ", err);
+		return 0;
+	}
+
+	UsageUpdatePlan update;
+	update.nThreads = m_lotman_conf.GetThreads();
+	if (update.nThreads == 0) {
+		update.nThreads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	update.nThreads = static_cast<unsigned>(std::max<size_t>(
+		1, std::min<size_t>(update.nThreads,
+							m_dir_tree.Size() / kMinDirsPerThread)));
+	update.dirBlocks = dirBlockCounts(purge_shot);
+
+	// Each shard only hears about its own top-level directories. The root
+	// directory itself is never sent.
+	update.shardDirs.resize(m_shards.size());
+	if (m_dir_tree.Size() > 0) {
+		for (auto dir = m_dir_tree.ChildrenBegin(0);
+			 dir != m_dir_tree.ChildrenEnd(0); ++dir) {
+			size_t shard = findShard(m_dir_tree.Name(*dir));
+			update.shardDirs[shard].push_back(static_cast<int>(*dir));
+		}
+	}
+
+	const time_t now = GetCurrentTime();
+	update.now = now;
+	update.fullSync = now - m_last_full_sync >=
+					  std::chrono::duration_cast<std::chrono::seconds>(
+						  m_lotman_conf.GetResync())
+						  .count();
+	// With local usage, LotMan's usage numbers aren't needed this cycle, as
+	// long as every shard's lots are known
+	bool deferUpdate = m_lotman_conf.GetLocalUsage();
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		if (!activateShard(i)) {
+			return 0;
+		}
+		// Pick up lots created or changed since the cache was last loaded
+		refreshLotCache();
+		Shard &shard = activeShard();
+		shard.lotUsageValid = false;
+		shard.lotManUsage.clear();
+		shard.updateGroups.clear();
+		if (shard.lotCacheLoaded) {
+			if (!shard.lotDirIndexBuilt) {
+				// The lots may have changed along with the cache, so every
+				// lot's candidates are worked out afresh
+				shard.lotDirIndex =
+					LotDirIndex(m_dir_tree, purge_shot, shard.lotCache);
+				shard.lotDirIndexBuilt = true;
+				shard.lotCandidates.clear();
+			} else {
+				invalidateLotCandidates(
+					shard.lotDirIndex.Update(m_dir_tree, purge_shot));
+			}
+			shard.updateGroups =
+				groupTopLevelDirsByLot(m_dir_tree, shard.lotCache);
+		}
+		if (m_lotman_conf.GetLocalUsage() && shard.lotCacheLoaded) {
+			shard.lotUsage =
+				aggregateLotUsage(m_dir_tree, purge_shot, shard.lotCache);
+			shard.lotUsageValid = true;
+		}
+		deferUpdate = deferUpdate && shard.lotUsageValid;
+	}
+	if (!deferUpdate && !sendShardUpdates(update)) {
+		return 0;
+	}
+
+	long long totalUsageB = 0;
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		if (!activateShard(i)) {
+			return 0;
+		}
+		// Get the total usage across the shard's root lots
+		totalUsageB += getTotalUsageB();
+	}
+	m_cycle_usage_ready = true;
+
+	long long HWMComparator;
+	long long LWMComparator;
+	long long nominalComparator;
+	if (!getPurgeLimits(HWMComparator, LWMComparator, nominalComparator)) {
+		return 0;
+	}
+
+	m_usage_trend.AddSample(now, totalUsageB);
+
+	long long bytesToRecover = 0;
+	if (totalUsageB >= HWMComparator) {
+		// Over the max, purge all the way down to the baseline
+		bytesToRecover = totalUsageB - LWMComparator;
+	} else if (m_lotman_conf.GetPredictive()) {
+		bytesToRecover = getPredictedBytesToRecover(totalUsageB, HWMComparator,
+													LWMComparator);
+		if (bytesToRecover > 0) {
+			m_log.Log(LogLevel::Info, "GetBytesToRecover",
+					  "Usage is projected to exceed the max before the next "
+					  "purge cycle, starting an early purge of ",
+					  bytesToRecover, " bytes");
+		}
+	}
+
+	// Between the nominal and the max, only take a little from lots that are
+	// past their limits, and leave the heavy purge to the baseline for when
+	// the max is actually reached
+	bool lightOnly = false;
+	if (bytesToRecover <= 0 && m_lotman_conf.GetGraduated()) {
+		bytesToRecover =
+			nominalTierTargetB(totalUsageB, nominalComparator, HWMComparator,
+							   m_lotman_conf.GetNominalBudgetB());
+		if (bytesToRecover > 0) {
+			lightOnly = true;
+			m_log.Log(LogLevel::Info, "GetBytesToRecover",
+					  "Usage is above the nominal, looking for up to ",
+					  bytesToRecover, " bytes with the light policies only");
+		}
+	}
+
+	if (bytesToRecover <= 0) {
+		// In this case, it's actually true that we have nothing to recover.
+		if (m_lotman_conf.GetPersist()) {
+			saveState();
+		}
+		if (deferUpdate) {
+			startUsageSync(std::move(update));
+		}
+		if (XRDLOTMAN_PROBE_ENABLED(cycle_done)) {
+			XRDLOTMAN_PROBE(cycle_done, 0ll, 0ul, nanosecondsSince(cycleStart));
+		}
+		return 0;
+	}
+
+	// We've determined there's something to purge
+	long long bytesRemaining = bytesToRecover;
+	m_log.Log(LogLevel::Info, "GetBytesToRecover", "Recoverable bytes: ",
+			  bytesToRecover, " bytes");
+
+	// Apply the policies to determine how much space to recover from each
+	// directory. These are applied in the order configured through the cache's
+	// configuration file.
+	applyPolicies(purge_shot, bytesRemaining, lightOnly);
+	if (lightOnly) {
+		// Nothing else needs to go yet, so don't have the cache make up
+		// whatever the light policies couldn't find
+		bytesToRecover -= bytesRemaining;
+		bytesRemaining = 0;
+	}
+	m_log.Log(LogLevel::Debug, "GetBytesToRecover", "Reused the candidates of ",
+			  m_candidates_reused, " lots and worked out ",
+			  m_candidates_computed, " afresh");
+
+	if (m_cycle_truncated) {
+		m_log.Log(LogLevel::Warning, "GetBytesToRecover",
+				  "Deadline reached during policy evaluation, returning the ",
+				  m_purge_dirs.size(),
+				  " candidate directories gathered so far");
+	}
+
+	// Policies may have picked both a directory and some of its
+	// subdirectories. Hand the cache a non-overlapping list so it doesn't
+	// traverse the same subtree more than once.
+	std::vector<PurgeCandidate> candidates =
+		collapseNestedCandidates(m_dir_tree, purge_shot, m_purge_dirs);
+	if (candidates.size() < m_purge_dirs.size()) {
+		m_log.Log(LogLevel::Debug, "GetBytesToRecover", "Merged ",
+				  m_purge_dirs.size() - candidates.size(),
+				  " nested candidate directories into their ancestors");
+	}
+
+	for (const auto &candidate : candidates) {
+		DirInfo update;
+		update.path = (std::filesystem::path(candidate.path) / "").string();
+		update.nBytesToRecover = candidate.bytesToRecover;
+
+		std::string dir = normalizeDirPath(candidate.path);
+		const DirUsage *usage = findDirUsage(purge_shot, dir);
+		long long dirUsageB = usage ? usage->m_StBlocks * BLKSZ : 0;
+		if (m_lotman_conf.GetFeedback()) {
+			// Ask for more (or less) than we need based on how much the cache
+			// delivered last time, and remember what we asked for.
+			update.nBytesToRecover = m_purge_efficiency.AdjustRequest(
+				dir, candidate.lotName, candidate.bytesToRecover, dirUsageB);
+			m_purge_efficiency.RecordRequest(dir, candidate.lotName,
+											 update.nBytesToRecover, dirUsageB);
+		}
+		// Next cycle's purge shot shows how much the directory really gave
+		// up, which the trend is credited with so it isn't mistaken for a
+		// drop in the fill rate
+		m_usage_trend.RecordPurgeRequest(dir, dirUsageB);
+
+		m_list.push_back(update);
+	}
+
+	// Whatever the cache has to find beyond the candidates can't be told
+	// apart from new writes next cycle, so it's credited as requested
+	m_usage_trend.RecordPurge(bytesRemaining);
+
+	if (m_lotman_conf.GetPersist()) {
+		saveState();
+	}
+	if (deferUpdate) {
+		startUsageSync(std::move(update));
+	}
+	if (XRDLOTMAN_PROBE_ENABLED(cycle_done)) {
+		XRDLOTMAN_PROBE(cycle_done, bytesToRecover, m_list.size(),
+						nanosecondsSince(cycleStart));
+	}
+
+	return bytesToRecover;
+}
+
+bool XrdPurgeLotMan::sendShardUpdates(const UsageUpdatePlan &plan) {
+	std::map<std::string, uint64_t> fingerprints;
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		if (!activateShard(i) ||
+			!sendUsageUpdate(plan.shardDirs[i], plan, fingerprints)) {
+			// Some batches may have made it and others not, so LotMan's view
+			// no longer matches anything that was sent. Send everything the
+			// next time around.
+			m_log.Log(LogLevel::Warning, "sendShardUpdates",
+					  "Usage update to LotMan did not complete, the next one "
+					  "will send every directory");
+			m_sent_fingerprints.clear();
+			m_last_full_sync = 0;
+			return false;
+		}
+	}
+	if (m_lotman_conf.GetIncremental()) {
+		m_sent_fingerprints = std::move(fingerprints);
+		if (plan.fullSync) {
+			m_last_full_sync = plan.now;
+		}
+	}
+	return true;
+}
+
+void XrdPurgeLotMan::startUsageSync(UsageUpdatePlan plan) {
+	const auto interval = std::chrono::duration_cast<std::chrono::seconds>(
+		m_lotman_conf.GetLotManSync());
+	if (plan.now - m_last_lotman_sync < interval.count()) {
+		return;
+	}
+	m_last_lotman_sync = plan.now;
+
+	// Nothing else talks to LotMan or replaces the directory tree until the
+	// next cycle waits for this, so the thread has LotMan, the tree, and the
+	// shard and fingerprint state, to itself
+	m_usage_sync = std::thread([this, plan = std::move(plan)]() {
+		if (!sendShardUpdates(plan)) {
+			// Try again at the end of the next cycle
+			m_last_lotman_sync = 0;
+		}
+	});
+}
+
+void XrdPurgeLotMan::waitForUsageSync() {
+	if (m_usage_sync.joinable()) {
+		m_usage_sync.join();
+	}
+}
+
+bool XrdPurgeLotMan::sendUsageUpdate(
+	const std::vector<int> &topDirs, const UsageUpdatePlan &plan,
+	std::map<std::string, uint64_t> &fingerprints) {
+	if (topDirs.empty()) {
+		return true;
+	}
+
+	const std::string &lotHome = activeShard().lotHome;
+	auto send = [&](const std::string &update, size_t numDirs) {
+		XRDLOTMAN_PROBE(usage_update, lotHome.c_str(), numDirs, update.size());
+		char *err;
+		auto rv = XRDLOTMAN_CALL("", lotman_update_lot_usage_by_dir,
+								 update.c_str(), false, &err);
+		if (rv != 0) {
+			m_log.Log(LogLevel::Error, "sendUsageUpdate",
+					  "Error updating lot usage by dir: ", err);
+			return false;
+		}
+		return true;
+	};
 
-	// While there's still global space to clear, get directory usage
-	// for each of the directories tied to each lot
-	for (int i = 0; lots[i] != nullptr; ++i) {
-		if (globalBRemaining == 0) {
+	// LotMan sets a lot's usage to the sum of the directories one update
+	// gives it, so every top-level directory a lot gets usage from has to go
+	// in the same batch. Without the lot cache there's no telling which do,
+	// and everything is sent as one group.
+	const auto &updateGroups = activeShard().updateGroups;
+	std::vector<std::vector<int>> groups;
+	std::unordered_map<size_t, size_t> groupIdx;
+	for (int dir : topDirs) {
+		auto it = updateGroups.find(std::string(m_dir_tree.Name(dir)));
+		if (it == updateGroups.end()) {
+			groups.assign(1, topDirs);
 			break;
 		}
+		auto [group, added] = groupIdx.try_emplace(it->second, groups.size());
+		if (added) {
+			groups.emplace_back();
+		}
+		groups[group->second].push_back(dir);
+	}
 
-		const std::string lotName = lots[i];
+	// Only a batch size can make for more than one batch, and only then is
+	// there anything to overlap sending with
+	const size_t batchLimit =
+		static_cast<size_t>(m_lotman_conf.GetUpdateBatchB());
+	std::optional<UsageUpdatePipeline> pipeline;
+	if (batchLimit > 0) {
+		pipeline.emplace(send);
+	}
+	size_t numBatches = 0;
+	auto push = [&](std::string batch, size_t numDirs) {
+		++numBatches;
+		return pipeline ? pipeline->Push(std::move(batch), numDirs)
+						: send(batch, numDirs);
+	};
 
-		// For each directory tied to a lot, get the usage and cumulatively
-		// track how much space we need to clear. This also takes into account
-		// other policies that may have already started aggregating space to
-		// clear from that directory as well.
-		std::map<std::string, long long> tmpMap =
-			lotPerDirUsageB(lotName, purgeShot);
-		for (const auto &[dir, bytesInDir] : tmpMap) {
-			if (globalBRemaining <= 0) {
-				break;
+	// The JSON is serialized straight from the tree a chunk of groups at a
+	// time, and each directory is serialized once, both to fingerprint it and
+	// to splice into the batch it's sent in. A chunk is big enough to give
+	// every thread its share. A batch is handed off as soon as the next group
+	// wouldn't fit, so LotMan applies it while the next chunk is being
+	// serialized. A group larger than the limit goes in a batch of its own.
+	const bool incremental = m_lotman_conf.GetIncremental();
+	const size_t chunkDirs =
+		plan.nThreads > 1 ? kMinDirsPerThread * plan.nThreads : 1;
+	std::string batch = "[";
+	size_t batchDirs = 0;
+	size_t numSent = 0;
+	bool failed = false;
+	for (size_t first = 0; first < groups.size() && !failed;) {
+		std::vector<int> chunk;
+		std::vector<size_t> groupEnd;
+		size_t numChunkDirs = 0;
+		size_t last = first;
+		for (; last < groups.size() && numChunkDirs < chunkDirs; ++last) {
+			for (int dir : groups[last]) {
+				chunk.push_back(dir);
+				numChunkDirs += m_dir_tree.SubtreeSize(dir);
 			}
-
-			long long toRecoverFromDir;
-			if (m_purge_dirs.find(dir) != m_purge_dirs.end()) {
-				// There's nothing left to clean up in this directory
-				if (m_purge_dirs[dir]->dir_b_remaining <= 0) {
-					continue;
+			groupEnd.push_back(chunk.size());
+		}
+		std::vector<std::string> dirJson =
+			serializeDirTrees(m_dir_tree, plan.dirBlocks, chunk, plan.nThreads);
+
+		size_t i = 0;
+		for (size_t end : groupEnd) {
+			const size_t groupDirs = end - i;
+			std::string groupJson;
+			bool changed = !incremental || plan.fullSync;
+			for (; i < end; ++i) {
+				if (incremental) {
+					uint64_t fp = fingerprint(dirJson[i]);
+					std::string path(m_dir_tree.Name(chunk[i]));
+					auto it = m_sent_fingerprints.find(path);
+					changed = changed || it == m_sent_fingerprints.end() ||
+							  it->second != fp;
+					fingerprints[std::move(path)] = fp;
 				}
-				// Clean out the rest of the dir, unless we don't have that much
-				// left to clear
-				toRecoverFromDir = std::min(m_purge_dirs[dir]->dir_b_remaining,
-											globalBRemaining);
-			} else {
-				// First time any policy has hit this dir, record it
-				toRecoverFromDir = std::min(bytesInDir, globalBRemaining);
-				m_purge_dirs[dir] = std::make_unique<PurgeDirCandidateStats>(
-					PurgeDirCandidateStats(0ll, bytesInDir));
+				if (!groupJson.empty()) {
+					groupJson += ',';
+				}
+				groupJson += dirJson[i];
+				std::string().swap(dirJson[i]);
+			}
+			// Leaving out an unchanged directory would reset its lots to the
+			// usage of the ones that did change, so a group is sent whole or
+			// not at all
+			if (!changed) {
+				continue;
 			}
 
-			// Tally values
-			m_purge_dirs[dir]->dir_b_to_purge += toRecoverFromDir;
-			globalBRemaining -= toRecoverFromDir;
-			m_purge_dirs[dir]->dir_b_remaining -= toRecoverFromDir;
+			// Room for the separator and the closing bracket
+			if (batchLimit > 0 && batchDirs > 0 &&
+				batch.size() + groupJson.size() + 2 > batchLimit) {
+				batch += ']';
+				if (!push(std::move(batch), batchDirs)) {
+					failed = true;
+					break;
+				}
+				batch = "[";
+				batchDirs = 0;
+			}
+			if (batchDirs > 0) {
+				batch += ',';
+			}
+			batch += groupJson;
+			batchDirs += groupDirs;
+			numSent += groupDirs;
 		}
+		first = last;
+	}
+	if (!failed && batchDirs > 0) {
+		batch += ']';
+		failed = !push(std::move(batch), batchDirs);
+	}
+	if (pipeline && !pipeline->Finish()) {
+		failed = true;
+	}
+	if (failed) {
+		return false;
 	}
 
-	return;
+	m_log.Log(LogLevel::Debug, "sendUsageUpdate", "Sent usage for ", numSent,
+			  " of ", topDirs.size(), " top-level directories to ", lotHome,
+			  " in ", numBatches, " batches");
+	return true;
 }
 
-// Scaffolding for policies that require purging partial lots
-void XrdPurgeLotMan::partialPurgePolicyBase(const DataFsPurgeshot &purgeShot,
-											long long &globalBRemaining,
-											XrdPfc::PurgePolicy policy) {
-	char **lots;
-	char *err;
-	// TODO: Come back and think about whether we want recursive children here
-	//       For now, I'm saying _yes_ because if a child takes up lots of space
-	//       but isn't past its own quota, we still want the option to clear it.
-	int rv{-1};
-	switch (policy) {
-	case XrdPfc::PurgePolicy::PastOpp:
-		rv = lotman_get_lots_past_opp(true, true, &lots, &err);
-		break;
-	case XrdPfc::PurgePolicy::PastDed:
-		rv = lotman_get_lots_past_ded(true, true, &lots, &err);
-		break;
-	default:
-		log->Emsg(
-			"XrdPurgeLotMan", "completePurgePolicyBase",
-			("Unexpected purge policy: " + getPolicyName(policy)).c_str());
-		return;
-	}
-	std::unique_ptr<char *[], LotDeleter> lots_partial_purge(lots,
-															 LotDeleter());
+std::string XrdPurgeLotMan::getWhatIfPath() {
+	return (std::filesystem::path(getLotHome()) / "xrootd-lotman.whatif")
+		.string();
+}
 
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "partialPurgePolicyBase",
-				  ("Error getting lots for policy " + getPolicyName(policy) +
-				   ": " + std::string(err))
-					  .c_str());
-		return;
+std::string XrdPurgeLotMan::getWhatIfResultPath() {
+	return getWhatIfPath() + ".result";
+}
+
+void XrdPurgeLotMan::runWhatIf(const DataFsPurgeshot &purge_shot) {
+	// The request is taken out of the way before anything else, so a bad one
+	// isn't tried again every cycle
+	const std::string path = getWhatIfPath();
+	std::stringstream requestText;
+	{
+		std::ifstream in(path);
+		requestText << in.rdbuf();
 	}
-	log->Emsg("XrdPurgeLotMan", "partialPurgePolicyBase",
-			  ("Purge policy " + getPolicyName(policy) +
-			   " requires clearing lots: " + convertListToString(lots))
-				  .c_str());
+	std::error_code ec;
+	std::filesystem::remove(path, ec);
 
-	// Get directory usage for each of the directories tied to each lot
-	for (int i = 0; lots[i] != nullptr; ++i) {
-		if (globalBRemaining <= 0) {
-			break;
-		}
+	// LotMan belongs to the background usage sync until it's done
+	waitForUsageSync();
 
-		const std::string lotName = lots[i];
+	json request = json::parse(requestText.str(), nullptr, false);
+	json result;
+	if (request.is_discarded() || !request.is_object()) {
+		result["error"] = "The request is not a JSON object";
+	} else {
+		result = evaluateWhatIf(request, purge_shot);
+	}
+	result["evaluated_at"] = time(nullptr);
+	if (result.contains("error")) {
+		m_log.Log(LogLevel::Warning, "runWhatIf", "Could not evaluate ", path,
+				  ": ", result["error"].get<std::string>());
+	}
 
-		// if past opp, then toRecover = total_usage - opp_usage - ded_usage
-		// if past ded, then toRecover = total_usage - ded_usage
-		long long toRecoverFromLot;
-		json usageQueryJSON;
-		usageQueryJSON["lot_name"] = lotName;
-		usageQueryJSON["total_GB"] = true;
-		usageQueryJSON["dedicated_GB"] = true;
-		if (policy == XrdPfc::PurgePolicy::PastOpp) {
-			usageQueryJSON["opportunistic_GB"] = true;
+	const std::string resultPath = getWhatIfResultPath();
+	const std::string tmpPath = resultPath + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::trunc);
+		out << result.dump(1, '\t') << '\n';
+		if (!out) {
+			m_log.Log(LogLevel::Error, "runWhatIf",
+					  "Could not write what-if result to ", tmpPath);
+			return;
 		}
+	}
+	std::filesystem::rename(tmpPath, resultPath, ec);
+	if (ec) {
+		m_log.Log(LogLevel::Error, "runWhatIf",
+				  "Could not replace what-if result at ", resultPath, ": ",
+				  ec.message());
+		return;
+	}
+	m_log.Log(LogLevel::Info, "runWhatIf", "Wrote what-if result to ",
+			  resultPath);
+}
 
-		char *output;
-		rv = lotman_get_lot_usage(usageQueryJSON.dump().c_str(), &output, &err);
-		if (rv != 0) {
-			log->Emsg("XrdPurgeLotMan", "partialPurgePolicyBase",
-					  ("Error getting lot usage for " + lotName + ": " +
-					   std::string(err))
-						  .c_str());
-			continue;
+json XrdPurgeLotMan::evaluateWhatIf(const json &request,
+									const DataFsPurgeshot &purge_shot) {
+	json result;
+	auto getSize = [&](const char *key, long long &size) {
+		if (!request.contains(key)) {
+			return true;
 		}
-
-		json usageJSON = json::parse(output);
-		double totalGB = usageJSON["total_GB"]["total"];
-		double dedGB = usageJSON["dedicated_GB"]["total"];
-		if (policy == XrdPfc::PurgePolicy::PastOpp) {
-			double oppGB = usageJSON["opportunistic_GB"]["total"];
-			toRecoverFromLot =
-				static_cast<long long>((totalGB - dedGB - oppGB) * GB2B);
-		} else {
-			toRecoverFromLot = static_cast<long long>((totalGB - dedGB) * GB2B);
+		const json &value = request[key];
+		if (value.is_number_integer()) {
+			size = value.get<long long>();
+		} else if (!value.is_string() ||
+				   !parseSizeOption(value.get<std::string>(), size)) {
+			return false;
 		}
+		return size > 0;
+	};
 
-		if (toRecoverFromLot > globalBRemaining) {
-			toRecoverFromLot = globalBRemaining;
-		}
+	long long maxB = -1;
+	long long baselineB = -1;
+	long long nominalB;
+	if (!request.contains("hwm") || !request.contains("lwm")) {
+		getPurgeLimits(maxB, baselineB, nominalB);
+	}
+	if (!getSize("hwm", maxB) || !getSize("lwm", baselineB)) {
+		result["error"] = "Invalid hwm or lwm";
+		return result;
+	}
+	if (maxB <= 0 || baselineB <= 0 || baselineB > maxB) {
+		result["error"] = "No usable hwm and lwm";
+		return result;
+	}
 
-		std::map<std::string, long long> tmpUsage =
-			lotPerDirUsageB(lotName, purgeShot);
-		for (const auto &[dir, bytesInDir] : tmpUsage) {
-			if (globalBRemaining <= 0 || toRecoverFromLot <= 0) {
-				break;
+	std::vector<PolicyStage> pipeline = m_lotman_conf.GetPipeline();
+	if (request.contains("policies")) {
+		if (!request["policies"].is_string()) {
+			result["error"] = "Invalid policies";
+			return result;
+		}
+		pipeline.clear();
+		std::istringstream iss(request["policies"].get<std::string>());
+		std::string token;
+		while (iss >> token) {
+			PolicyStage stage;
+			if (!parsePolicyStage(token, stage)) {
+				result["error"] = "Invalid policy: " + token;
+				return result;
 			}
+			pipeline.push_back(stage);
+		}
+		if (pipeline.empty()) {
+			result["error"] = "No policies given";
+			return result;
+		}
+	}
 
-			long long toRecoverFromDir;
-			if (m_purge_dirs.find(dir) != m_purge_dirs.end()) {
-				// There's nothing left to clean up in this directory
-				if (m_purge_dirs[dir]->dir_b_remaining <= 0) {
-					continue;
-				}
-
-				// there's space left to clear. Get rid of as much of it as we
-				// need to
-				toRecoverFromDir = std::min(m_purge_dirs[dir]->dir_b_remaining,
-											toRecoverFromLot);
-			} else {
-				// First time we've seen this dir as a candidate, record it
-				toRecoverFromDir = std::min(bytesInDir, toRecoverFromLot);
-				m_purge_dirs[dir] = std::make_unique<PurgeDirCandidateStats>(
-					PurgeDirCandidateStats(0ll, bytesInDir));
-			}
+	// Run the policies on the side. Everything they touch, from the cached
+	// candidates and usage of every shard to which lot home LotMan points
+	// at, is put back the way the real cycle left it afterwards, so the next
+	// cycle can't tell a what-if was run.
+	const std::vector<PolicyStage> configuredPipeline =
+		m_lotman_conf.GetPipeline();
+	std::map<std::string, std::unique_ptr<PurgeDirCandidateStats>> purgeDirs;
+	purgeDirs.swap(m_purge_dirs);
+	const std::vector<Shard> shards = m_shards;
+	const size_t activeShardIdx = m_active_shard;
+	const bool cycleTruncated = m_cycle_truncated;
+	const auto cycleDeadline = m_cycle_deadline;
+	const size_t shardRotation = m_shard_rotation;
+	auto restoreCycleState = [&]() {
+		m_lotman_conf.SetPipeline(configuredPipeline);
+		m_purge_dirs.swap(purgeDirs);
+		m_shards = shards;
+		activateShard(activeShardIdx);
+		m_cycle_truncated = cycleTruncated;
+		m_cycle_deadline = cycleDeadline;
+		m_shard_rotation = shardRotation;
+	};
 
-			m_purge_dirs[dir]->dir_b_to_purge += toRecoverFromDir;
-			globalBRemaining -= toRecoverFromDir;
-			toRecoverFromLot -= toRecoverFromDir;
-			m_purge_dirs[dir]->dir_b_remaining -= toRecoverFromDir;
+	long long totalUsageB = 0;
+	for (size_t i = 0; i < m_shards.size(); ++i) {
+		if (!activateShard(i)) {
+			result["error"] = "Could not switch to lot home " +
+							  m_shards[i].lotHome;
+			restoreCycleState();
+			return result;
 		}
+		totalUsageB += getTotalUsageB();
 	}
+	const long long bytesToRecover =
+		totalUsageB >= maxB ? totalUsageB - baselineB : 0;
 
-	return;
+	m_lotman_conf.SetPipeline(pipeline);
+	startCycleDeadline();
+	const auto start = std::chrono::steady_clock::now();
+	long long bytesRemaining = bytesToRecover;
+	if (bytesToRecover > 0) {
+		applyPolicies(purge_shot, bytesRemaining);
+	}
+	std::vector<PurgeCandidate> candidates =
+		collapseNestedCandidates(m_dir_tree, purge_shot, m_purge_dirs);
+	const auto durationMs =
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start)
+			.count();
+	const bool truncated = m_cycle_truncated;
+	restoreCycleState();
+
+	json policies = json::array();
+	for (const auto &stage : pipeline) {
+		policies.push_back(stage.configName);
+	}
+	json candidateList = json::array();
+	for (const auto &candidate : candidates) {
+		candidateList.push_back({{"path", candidate.path},
+								 {"lot", candidate.lotName},
+								 {"bytes", candidate.bytesToRecover}});
+	}
+	result["hwm"] = maxB;
+	result["lwm"] = baselineB;
+	result["policies"] = std::move(policies);
+	result["usage"] = totalUsageB;
+	result["bytes_to_recover"] = bytesToRecover;
+	result["bytes_found"] = bytesToRecover - bytesRemaining;
+	result["truncated"] = truncated;
+	result["duration_ms"] = durationMs;
+	result["candidates"] = std::move(candidateList);
+	return result;
 }
 
-/*
-Handles determining the total number of bytes to recover,
-as well as populating the m_list of directories:bytesToRecover the purge cycle
-iterates over when clearing stuff.
-
-In LotMan's ideal case, we could say "here's the ordering of directories, keep
-clearing until you hit LWM," but the purge code doesn't quite have the logic for
-that, so handle this determination in the plugin.
-*/
-long long XrdPurgeLotMan::GetBytesToRecover(const DataFsPurgeshot &purge_shot) {
-	// reset m_list
-	m_list.clear();
-	m_purge_dirs.clear();
+std::string XrdPurgeLotMan::getStateFilePath() {
+	return (std::filesystem::path(getLotHome()) / "xrootd-lotman.state")
+		.string();
+}
 
-	char *err;
-	char *output;
-	auto rv = lotman_get_context_str("lot_home", &output, &err);
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "GetBytesToRecover",
-				  "Error getting lot home:", err);
-		return 0;
+bool XrdPurgeLotMan::saveState() {
+	StateWriter payload;
+	m_usage_trend.Save(payload);
+	m_purge_efficiency.Save(payload);
+	payload.PutI64(m_last_full_sync);
+	payload.PutU64(m_sent_fingerprints.size());
+	for (const auto &[path, fp] : m_sent_fingerprints) {
+		payload.PutString(path);
+		payload.PutU64(fp);
 	}
-	auto lotUpdateJson = reconstructPathsAndBuildJson(purge_shot);
 
-	rv = lotman_update_lot_usage_by_dir(lotUpdateJson.dump().c_str(), false,
-										&err);
-	if (rv != 0) {
-		log->Emsg("XrdPurgeLotMan", "GetBytesToRecover",
-				  "Error updating lot usage by dir:", err);
-		return 0;
+	StateWriter header;
+	header.PutString("XrdPurgeLotMan");
+	header.PutU64(kStateVersion);
+	header.PutU64(fingerprint(payload.Data()));
+
+	// Write to the side and rename over the old checkpoint so a crash
+	// mid-write never leaves a half-written file behind
+	const std::string path = getStateFilePath();
+	const std::string tmpPath = path + ".tmp";
+	{
+		std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+		out.write(header.Data().data(), header.Data().size());
+		out.write(payload.Data().data(), payload.Data().size());
+		if (!out) {
+			m_log.Log(LogLevel::Error, "saveState",
+					  "Could not write plugin state to ", tmpPath);
+			return false;
+		}
 	}
 
-	long long HWMComparator;
-	long long LWMComparator;
-	// Prefer file usage info, but fall back to HWM/LWM if not available
-	if (GetConfiguredFUsageBaseline() > 0 && GetConfiguredFUsageNominal() > 0 &&
-		GetConfiguredFUsageMax() > 0) {
-		HWMComparator = GetConfiguredFUsageMax();
-		LWMComparator = GetConfiguredFUsageBaseline();
-	} else if (GetConfiguredHWM() > 0 && GetConfiguredLWM() > 0) {
-		HWMComparator = GetConfiguredHWM();
-		LWMComparator = GetConfiguredLWM();
-	} else {
-		log->Emsg("XrdPurgeLotMan", "GetBytesToRecover",
-				  "No valid HWM/LWM or file usage info available. Cannot "
-				  "determine how much to recover.");
-		return 0;
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, path, ec);
+	if (ec) {
+		m_log.Log(LogLevel::Error, "saveState",
+				  "Could not replace plugin state at ", path, ": ",
+				  ec.message());
+		return false;
 	}
+	return true;
+}
 
-	// Get the total usage across root lots.
-	long long totalUsageB = getTotalUsageB();
-	if (totalUsageB < HWMComparator) {
-		// In this case, it's actually true that we have nothing to recover.
-		return 0;
+bool XrdPurgeLotMan::loadState() {
+	const std::string path = getStateFilePath();
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		// Nothing saved yet
+		return false;
+	}
+	std::string data((std::istreambuf_iterator<char>(in)),
+					 std::istreambuf_iterator<char>());
+
+	StateReader reader(data);
+	std::string magic;
+	uint64_t version, checksum;
+	if (!reader.GetString(magic) || magic != "XrdPurgeLotMan" ||
+		!reader.GetU64(version) || !reader.GetU64(checksum)) {
+		m_log.Log(LogLevel::Warning, "loadState",
+				  "Ignoring unrecognized plugin state in ", path);
+		return false;
+	}
+	if (version != kStateVersion) {
+		m_log.Log(LogLevel::Warning, "loadState",
+				  "Ignoring plugin state from version ", version, " in ", path);
+		return false;
+	}
+	std::string_view payload = std::string_view(data).substr(reader.Position());
+	if (fingerprint(payload) != checksum) {
+		m_log.Log(LogLevel::Warning, "loadState",
+				  "Ignoring damaged plugin state in ", path);
+		return false;
 	}
 
-	// We've determined there's something to purge
-	long long bytesToRecover = totalUsageB - LWMComparator;
-	long long bytesRemaining = bytesToRecover;
-	log->Emsg(
-		"XrdPurgeLotMan", "GetBytesToRecover",
-		("Recoverable bytes: " + std::to_string(bytesToRecover) + " bytes")
-			.c_str());
-
-	// Apply the policies to determine how much space to recover from each
-	// directory. These are applied in the order configured through the cache's
-	// configuration file.
-	applyPolicies(purge_shot, bytesRemaining);
-
-	for (const auto &[dir, stats] : m_purge_dirs) {
-		DirInfo update;
-		update.path = (std::filesystem::path(dir) / "").string();
-		update.nBytesToRecover = stats->dir_b_to_purge;
-
-		m_list.push_back(update);
+	reader = StateReader(payload);
+	UsageTrend usageTrend;
+	PurgeEfficiencyTracker purgeEfficiency;
+	int64_t lastFullSync;
+	uint64_t count;
+	std::map<std::string, uint64_t> sentFingerprints;
+	bool ok = usageTrend.Load(reader) && purgeEfficiency.Load(reader) &&
+			  reader.GetI64(lastFullSync) && reader.GetU64(count);
+	for (uint64_t i = 0; ok && i < count; ++i) {
+		std::string dir;
+		uint64_t fp;
+		ok = reader.GetString(dir) && reader.GetU64(fp);
+		sentFingerprints[dir] = fp;
+	}
+	if (!ok || !reader.Done()) {
+		m_log.Log(LogLevel::Warning, "loadState",
+				  "Ignoring damaged plugin state in ", path);
+		return false;
 	}
 
-	return bytesToRecover;
+	m_usage_trend = std::move(usageTrend);
+	m_purge_efficiency = std::move(purgeEfficiency);
+	m_last_full_sync = lastFullSync;
+	m_sent_fingerprints = std::move(sentFingerprints);
+	m_log.Log(LogLevel::Info, "loadState", "Restored plugin state from ", path,
+			  " with ", m_sent_fingerprints.size(),
+			  " top-level usage fingerprints");
+	return true;
 }
 
 // Read the cache's purge lib configuration, and apply the policies in the order
@@ -474,12 +3156,17 @@ bool XrdPurgeLotMan::validateConfiguration(const char *params) {
 	char delim = ' ';
 
 	while (getline(iss, token, delim)) {
-		paramVec.push_back(token);
+		if (!token.empty()) {
+			paramVec.push_back(token);
+		}
 	}
 
-	// At minimum, we have a lot home, and potentially up to 4 policies
-	assert(paramVec.size() >= 1);
-	assert(paramVec.size() <= 5);
+	// At minimum, we have a lot home, followed by policies and options
+	if (paramVec.empty()) {
+		log->Emsg("XrdPurgeLotMan", "validateConfiguration",
+				  "No lot home was provided.");
+		return false;
+	}
 
 	// Get LotHome
 	std::filesystem::path lotHome(paramVec[0]);
@@ -493,41 +3180,285 @@ bool XrdPurgeLotMan::validateConfiguration(const char *params) {
 	}
 	cfg.SetLotHome(lotHome.string());
 
-	std::vector<PurgePolicy> policies;
-	std::set<PurgePolicy> encountered;
+	std::vector<PolicyStage> pipeline;
 	for (size_t i = 1; i < paramVec.size(); ++i) {
-		PurgePolicy policy = getPolicyFromConfigName(paramVec[i]);
-		if (policy == PurgePolicy::UnknownPolicy) {
-			log->Emsg("XrdPurgeLotMan", "validateConfiguration",
-					  ("Unknown policy: " + paramVec[i]).c_str());
-			return false;
+		// Anything of the form key=value is an option rather than a policy,
+		// while policy parameters always follow a `<policy>:` prefix
+		const std::string &param = paramVec[i];
+		size_t equals = param.find('=');
+		if (equals != std::string::npos && param.find(':') > equals) {
+			if (!parseConfigOption(param, cfg)) {
+				return false;
+			}
+			continue;
 		}
-		// Insert and check for duplicates in one step
-		auto result = encountered.insert(policy);
-		if (!result.second) {
-			log->Emsg("XrdPurgeLotMan", "validateConfiguration",
-					  ("Duplicate policy detected: " + paramVec[i]).c_str());
+
+		PolicyStage stage;
+		if (!parsePolicyStage(param, stage)) {
 			return false;
 		}
+		// The same policy may run more than once, but only with different
+		// parameters
+		for (const auto &existing : pipeline) {
+			if (existing.policy == stage.policy &&
+				existing.params == stage.params) {
+				log->Emsg("XrdPurgeLotMan", "validateConfiguration",
+						  ("Duplicate policy detected: " + param).c_str());
+				return false;
+			}
+		}
 
-		policies.push_back(policy);
+		pipeline.push_back(stage);
 	}
 
 	// Use default policies if none are provided
-	if (policies.empty()) {
-		policies = {PurgePolicy::PastDel, PurgePolicy::PastExp,
-					PurgePolicy::PastOpp, PurgePolicy::PastDed};
+	if (pipeline.empty()) {
+		cfg.SetPolicy({PurgePolicy::PastDel, PurgePolicy::PastExp,
+					   PurgePolicy::PastOpp, PurgePolicy::PastDed});
+	} else {
+		cfg.SetPipeline(pipeline);
 	}
 
-	cfg.SetPolicy(policies);
 	m_lotman_conf = cfg;
+	m_log.SetLevel(cfg.GetLogLevel());
+
+	return true;
+}
+
+// Parse a single `key=value` option from the purge lib configuration
+bool XrdPurgeLotMan::parseConfigOption(const std::string &option,
+									   LotManConfiguration &cfg) {
+	auto pos = option.find('=');
+	std::string key = option.substr(0, pos);
+	std::string value = option.substr(pos + 1);
+
+	if (key == "predictive") {
+		bool predictive;
+		if (!parseBoolOption(value, predictive)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'predictive': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetPredictive(predictive);
+	} else if (key == "feedback") {
+		bool feedback;
+		if (!parseBoolOption(value, feedback)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'feedback': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetFeedback(feedback);
+	} else if (key == "deadline") {
+		std::chrono::milliseconds deadline;
+		if (!parseDurationOption(value, deadline)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'deadline': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetDeadline(deadline);
+	} else if (key == "warmstart") {
+		bool warmStart;
+		if (!parseBoolOption(value, warmStart)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'warmstart': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetWarmStart(warmStart);
+	} else if (key == "lotcachettl") {
+		std::chrono::milliseconds ttl;
+		if (!parseDurationOption(value, ttl)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'lotcachettl': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetLotCacheTTL(ttl);
+	} else if (key == "persist") {
+		bool persist;
+		if (!parseBoolOption(value, persist)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'persist': " + value).c_str());
+			return false;
+		}
+		cfg.SetPersist(persist);
+	} else if (key == "incremental") {
+		bool incremental;
+		if (!parseBoolOption(value, incremental)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'incremental': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetIncremental(incremental);
+	} else if (key == "resync") {
+		std::chrono::milliseconds resync;
+		if (!parseDurationOption(value, resync)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'resync': " + value).c_str());
+			return false;
+		}
+		cfg.SetResync(resync);
+	} else if (key == "updatebatch") {
+		long long batchB;
+		if (!parseSizeOption(value, batchB)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'updatebatch': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetUpdateBatchB(batchB);
+	} else if (key == "shard") {
+		// shard=/<top-level dir>:<lot home>
+		size_t colon = value.find(':');
+		std::string prefix = normalizeDirPath(value.substr(0, colon));
+		if (colon == std::string::npos || prefix.size() < 2 ||
+			prefix[0] != '/' || prefix.find('/', 1) != std::string::npos) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'shard': " + value).c_str());
+			return false;
+		}
+		std::filesystem::path lotHome(value.substr(colon + 1));
+		if (!std::filesystem::is_directory(lotHome)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("The lot home of '" + lotHome.string() +
+					   "' for shard " + prefix + " does not exist.")
+						  .c_str());
+			return false;
+		}
+		for (const auto &shard : cfg.GetShards()) {
+			if (shard.first == prefix) {
+				log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+						  ("Duplicate shard for " + prefix).c_str());
+				return false;
+			}
+		}
+		cfg.AddShard(prefix, lotHome.string());
+	} else if (key == "localusage") {
+		bool localUsage;
+		if (!parseBoolOption(value, localUsage)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'localusage': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetLocalUsage(localUsage);
+	} else if (key == "lotmansync") {
+		std::chrono::milliseconds interval;
+		if (!parseDurationOption(value, interval)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'lotmansync': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetLotManSync(interval);
+	} else if (key == "graduated") {
+		bool graduated;
+		if (!parseBoolOption(value, graduated)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'graduated': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetGraduated(graduated);
+	} else if (key == "nominalbudget") {
+		long long budgetB;
+		if (!parseSizeOption(value, budgetB)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'nominalbudget': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetNominalBudgetB(budgetB);
+	} else if (key == "loglevel") {
+		LogLevel level;
+		if (!parseLogLevel(value, level)) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'loglevel': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetLogLevel(level);
+	} else if (key == "threads") {
+		unsigned long threads;
+		try {
+			threads = std::stoul(value);
+		} catch (const std::exception &) {
+			log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+					  ("Invalid value for option 'threads': " + value)
+						  .c_str());
+			return false;
+		}
+		cfg.SetThreads(static_cast<unsigned>(threads));
+	} else {
+		log->Emsg("XrdPurgeLotMan", "parseConfigOption",
+				  ("Unknown option: " + key).c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// Parse a policy stage of the form `<policy>[:<key>=<value>[,...]]`
+bool XrdPurgeLotMan::parsePolicyStage(const std::string &token,
+									  PolicyStage &stage) {
+	auto colon = token.find(':');
+	std::string name = token.substr(0, colon);
+	PurgePolicy policy = getPolicyFromConfigName(name);
+	if (policy == PurgePolicy::UnknownPolicy) {
+		log->Emsg("XrdPurgeLotMan", "parsePolicyStage",
+				  ("Unknown policy: " + name).c_str());
+		return false;
+	}
+
+	PolicyStageParams params;
+	if (colon != std::string::npos) {
+		std::istringstream iss(token.substr(colon + 1));
+		std::string param;
+		while (getline(iss, param, ',')) {
+			auto eq = param.find('=');
+			std::string key = param.substr(0, eq);
+			std::string value =
+				eq == std::string::npos ? "" : param.substr(eq + 1);
+
+			bool valid = false;
+			if (key == "budget") {
+				valid = parseSizeOption(value, params.budgetB);
+			} else if (key == "minage" &&
+					   policy == PurgePolicy::SizeOrderedLRU) {
+				std::chrono::milliseconds minAge;
+				valid = parseDurationOption(value, minAge);
+				params.minAge =
+					std::chrono::duration_cast<std::chrono::seconds>(minAge);
+			} else {
+				log->Emsg("XrdPurgeLotMan", "parsePolicyStage",
+						  ("Unknown parameter '" + key + "' for policy " +
+						   name)
+							  .c_str());
+				return false;
+			}
+
+			if (!valid) {
+				log->Emsg("XrdPurgeLotMan", "parsePolicyStage",
+						  ("Invalid value for parameter '" + key +
+						   "' of policy " + name + ": " + value)
+							  .c_str());
+				return false;
+			}
+		}
+	}
 
+	stage = makePolicyStage(policy, params);
 	return true;
 }
 
 // Handle configuration for the plugin
 bool XrdPurgeLotMan::ConfigPurgePin(const char *params) {
 	(void)params; // Avoid unused parameter warning
+	waitForUsageSync();
 
 	if (!validateConfiguration(params)) {
 		log->Emsg("XrdPurgeLotMan", "ConfigPurgePin",
@@ -536,7 +3467,8 @@ bool XrdPurgeLotMan::ConfigPurgePin(const char *params) {
 	};
 
 	char *err;
-	auto rv = lotman_set_context_str("lot_home", getLotHome().c_str(), &err);
+	auto rv = XRDLOTMAN_CALL("", lotman_set_context_str, "lot_home",
+							 getLotHome().c_str(), &err);
 	if (rv != 0) {
 		log->Emsg("XrdPurgeLotMan", "ConfigPurgePin",
 				  ("Error setting lot home to '" + getLotHome() +
@@ -545,6 +3477,41 @@ bool XrdPurgeLotMan::ConfigPurgePin(const char *params) {
 		return false;
 	}
 
+	m_shards.assign(1, Shard{});
+	m_shards[0].lotHome = getLotHome();
+	for (const auto &[prefix, lotHome] : m_lotman_conf.GetShards()) {
+		Shard shard;
+		shard.topLevelDir = prefix.substr(1);
+		shard.lotHome = lotHome;
+		m_shards.push_back(std::move(shard));
+	}
+	m_active_shard = 0;
+
+	// Do the lot discovery the first purge cycle would otherwise do, so it
+	// performs like any other and a broken LotMan setup is caught right away
+	if (m_lotman_conf.GetWarmStart()) {
+		for (size_t i = 0; i < m_shards.size(); ++i) {
+			if (!activateShard(i) || !loadLotCache()) {
+				log->Emsg("XrdPurgeLotMan", "ConfigPurgePin",
+						  ("Could not load lots from the lot home '" +
+						   m_shards[i].lotHome + "'")
+							  .c_str());
+				return false;
+			}
+		}
+		if (!activateShard(0)) {
+			return false;
+		}
+	}
+
+	// Pick up where the last run left off. Without a checkpoint, the first
+	// cycle sends LotMan everything.
+	m_sent_fingerprints.clear();
+	m_last_full_sync = 0;
+	if (m_lotman_conf.GetPersist()) {
+		loadState();
+	}
+
 	return true;
 }
 
@@ -4,10 +4,24 @@
 #include <XrdPfc/XrdPfc.hh>
 #include <XrdPfc/XrdPfcDirStateSnapshot.hh>
 #include <XrdPfc/XrdPfcPurgePin.hh>
+#include <XrdSys/XrdSysError.hh>
 
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
 #include <filesystem>
+#include <functional>
 #include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
 
 #define GB2B (1000ll * 1000ll * 1000ll)
@@ -18,7 +32,7 @@ using json = nlohmann::json;
 
 namespace {
 // Function to convert char*** to std::string for logging
-std::string convertListToString(char **stringArr) {
+inline std::string convertListToString(char **stringArr) {
 	if (stringArr == nullptr) {
 		return "";
 	}
@@ -31,87 +45,572 @@ std::string convertListToString(char **stringArr) {
 	}
 	return result;
 }
+} // End of anonymous namespace
 
-struct DirNode {
-	std::filesystem::path path;
-	std::vector<DirNode *> subDirs; // Pointers to subdirectories
-};
-
-// Given a DirNode, convert it to the JSON object used by LotMan for updating
-// lot usage
-json dirNodeToJson(const DirNode *node,
-				   const XrdPfc::DataFsPurgeshot &purge_shot) {
-	nlohmann::json dirJson;
-	std::filesystem::path dirPath(node->path);
-	dirJson["path"] = dirPath.filename().string();
-
-	const auto usage = purge_shot.find_dir_usage_for_dir_path(node->path);
-	if (usage) {
-		dirJson["size_GB"] =
-			(static_cast<double>(usage->m_StBlocks) * BLKSZ) / GB2B;
-	} else {
-		dirJson["size_GB"] = 0.0;
-	}
+namespace XrdPfc {
 
-	if (!node->subDirs.empty()) {
-		dirJson["includes_subdirs"] = true;
-		for (const auto *subDir : node->subDirs) {
-			dirJson["subdirs"].push_back(dirNodeToJson(subDir, purge_shot));
-		}
-	} else {
-		dirJson["includes_subdirs"] = false;
+enum class PurgePolicy {
+	PastDel,
+	PastExp,
+	PastOpp,
+	PastDed,
+	PastObj,
+	SizeOrderedLRU,
+	UnknownPolicy
+};
+
+// Per-stage parameters, given in the purge lib configuration as
+// `<policy>:<key>=<value>[,<key>=<value>...]`, e.g. `opp:budget=50g`.
+struct PolicyStageParams {
+	// The most bytes this stage may claim in a single purge cycle. Zero means
+	// the stage is only bounded by the overall number of bytes to recover.
+	long long budgetB{0};
+	// Ignore directories that were accessed more recently than this. Only
+	// used by the size-ordered LRU stage.
+	std::chrono::seconds minAge{0};
+
+	bool operator==(const PolicyStageParams &other) const {
+		return budgetB == other.budgetB && minAge == other.minAge;
 	}
+};
+
+struct PurgeDirCandidateStats {
+	PurgeDirCandidateStats() : dir_b_to_purge{0}, dir_b_remaining{0} {};
+
+	PurgeDirCandidateStats(const long long toPurge, const long long remaining,
+						   const std::string &lot = "")
+		: dir_b_to_purge{toPurge}, dir_b_remaining{remaining}, lot_name{lot} {};
+
+	long long dir_b_to_purge;
+	long long dir_b_remaining;
+	// The lot whose policy first picked this directory
+	std::string lot_name;
+};
+
+// A directory and the number of bytes the cache should clear from it, in the
+// form that's handed to the cache through m_list
+struct PurgeCandidate {
+	std::string path;
+	long long bytesToRecover;
+	std::string lotName;
+};
+
+std::string getPolicyName(PurgePolicy policy);
+PurgePolicy getPolicyFromConfigName(const std::string &name);
+
+// Parse the boolean value of a `key=value` plugin option. Accepts on/off,
+// true/false, yes/no and 1/0.
+bool parseBoolOption(const std::string &value, bool &result);
+
+// Parse a duration option such as `500ms`, `30s`, `5m`, `1h` or `7d`. A bare
+// number is taken to be seconds.
+bool parseDurationOption(const std::string &value,
+						 std::chrono::milliseconds &result);
 
-	return dirJson;
+// Parse a size option such as `512k`, `50g` or `2t`, using the same
+// power-of-1024 suffixes as the cache's own configuration. A bare number is
+// taken to be bytes.
+bool parseSizeOption(const std::string &value, long long &result);
+
+// LotMan deals in (decimal) GB, while the plugin keeps every size in bytes.
+// Sizes are only converted where they're handed to or read from LotMan, and
+// are rounded to the nearest byte rather than truncated.
+inline long long gbToBytes(double gb) { return std::llround(gb * GB2B); }
+inline double bytesToGB(long long bytes) {
+	return static_cast<double>(bytes) / GB2B;
 }
 
-// Loop over the purge_shot's directory vector, and reconstruct the paths for
-// LotMan. Doing this allows us to build a usage update JSON, which tells LotMan
+// bytes * numerator / denominator, rounded down, without overflowing for
+// numerators and denominators up to 2^31 or losing precision to a double
+long long scaleBytes(long long bytes, long long numerator,
+					 long long denominator);
+
+// How much the light policy stages should look for when usage sits between
+// the nominal and max file usage: the excess over the nominal, capped by the
+// per-cycle budget, or a tenth of the distance between the two without one.
+// Zero outside that range.
+long long nominalTierTargetB(long long usageB, long long nominalB,
+							 long long maxB, long long budgetB);
+
+// Strip any trailing slashes so paths from LotMan and the cache compare equal
+std::string normalizeDirPath(const std::string &path);
+
+// Run `task(i)` for every i in [0, nTasks) on up to nThreads threads. Threads
+// pull the next unclaimed task as soon as they finish their current one, so
+// uneven tasks still balance out. Any exception thrown by a task is rethrown
+// once all threads have finished.
+void runInParallel(size_t nTasks, unsigned nThreads,
+				   const std::function<void(size_t)> &task);
+
+// 64-bit FNV-1a hash. Unlike std::hash, it's the same across builds and
+// platforms, so it's safe to persist.
+uint64_t fingerprint(std::string_view data);
+
+// Encoding for the state the plugin keeps across restarts. Numbers are stored
+// little-endian with a fixed width and strings are length-prefixed.
+class StateWriter {
+  public:
+	void PutU64(uint64_t value);
+	void PutI64(int64_t value) { PutU64(static_cast<uint64_t>(value)); }
+	void PutDouble(double value);
+	void PutString(std::string_view value);
+	const std::string &Data() const { return m_data; }
+
+  private:
+	std::string m_data;
+};
+
+// Reads back what a StateWriter wrote. Every getter returns false instead of
+// reading past the end of the data.
+class StateReader {
+  public:
+	StateReader(std::string_view data) : m_data{data} {}
+
+	bool GetU64(uint64_t &value);
+	bool GetI64(int64_t &value);
+	bool GetDouble(double &value);
+	bool GetString(std::string &value);
+	size_t Position() const { return m_pos; }
+	bool Done() const { return m_pos == m_data.size(); }
+
+  private:
+	std::string_view m_data;
+	size_t m_pos{0};
+};
+
+// A compact, read-only copy of the purge shot's directory structure, indexed
+// the same way as the purge shot's m_dir_vec. Rather than holding each
+// directory's full path, every directory stores its parent index, a range in a
+// shared child list and the location of its name in an arena where identical
+// names are only stored once. Full paths are only built when asked for, either
+// one at a time through Path() or for a whole subtree through a PathIterator.
+class DirTree {
+  public:
+	DirTree() = default;
+	explicit DirTree(const DataFsPurgeshot &purge_shot);
+
+	size_t Size() const { return m_parent.size(); }
+	int Parent(int idx) const { return m_parent[idx]; }
+	std::string_view Name(int idx) const {
+		return std::string_view(m_names).substr(m_name_offset[idx],
+												m_name_len[idx]);
+	}
+
+	// Children of a directory, as a range of directory indices
+	const uint32_t *ChildrenBegin(int idx) const {
+		return m_children.data() + m_child_offset[idx];
+	}
+	const uint32_t *ChildrenEnd(int idx) const {
+		return m_children.data() + m_child_offset[idx + 1];
+	}
+	size_t NumChildren(int idx) const {
+		return m_child_offset[idx + 1] - m_child_offset[idx];
+	}
+
+	// Number of directories in a directory's subtree, itself included
+	size_t SubtreeSize(int idx) const { return m_subtree_size[idx]; }
+
+	int Depth(int idx) const;
+
+	// Build the full path of a directory. The root directory maps to "/".
+	std::string Path(int idx) const;
+
+	// Find a directory by its full path, or return -1 if it isn't in the tree
+	int Find(const std::string &path) const;
+	// Whether a directory has the given full path. Much cheaper than Find,
+	// since it only follows the directory's parents.
+	bool IsAt(int idx, std::string_view path) const;
+
+	// Approximate heap footprint of the tree, in bytes
+	size_t MemoryUsage() const;
+
+	// Visits a subtree depth first, keeping the current directory's full path
+	// in a single buffer that's reused from one directory to the next
+	class PathIterator {
+	  public:
+		PathIterator(const DirTree &tree, int start);
+
+		bool Done() const { return m_stack.empty(); }
+		void Next();
+		int Index() const { return m_stack.back().first; }
+		const std::string &Path() const { return m_path; }
+
+	  private:
+		void enterTop();
+
+		const DirTree &m_tree;
+		// Directories still to visit, along with the length of their parent's
+		// path
+		std::vector<std::pair<int, size_t>> m_stack;
+		std::string m_path;
+	};
+
+	PathIterator Walk(int start = 0) const {
+		return PathIterator(*this, start);
+	}
+
+  private:
+	std::vector<int32_t> m_parent;
+	std::vector<uint32_t> m_child_offset;
+	std::vector<uint32_t> m_children;
+	std::vector<uint32_t> m_name_offset;
+	std::vector<uint32_t> m_name_len;
+	std::vector<uint32_t> m_subtree_size;
+	std::string m_names;
+};
+
+// Given a directory in the tree, convert it to the JSON object used by LotMan
+// for updating lot usage
+json dirTreeToJson(const DirTree &tree, int idx,
+				   const DataFsPurgeshot &purge_shot);
+
+// The block count of every directory in the purge shot, in the same order, for
+// building usage updates once the purge shot is gone
+std::vector<long long> dirBlockCounts(const DataFsPurgeshot &purge_shot);
+
+// Append the JSON object dirTreeToJson would build for a directory to `out`,
+// already serialized. Nothing but the output grows with the subtree, so it's
+// fit for serializing large trees a piece at a time.
+void appendDirTreeJson(std::string &out, const DirTree &tree, int idx,
+					   const std::vector<long long> &dirBlocks);
+
+// Serialize the subtree of each of the given directories with
+// appendDirTreeJson, one string per directory. With more than one thread, the
+// subtrees are split up and serialized in parallel the same way
+// reconstructPathsAndBuildJson does it.
+std::vector<std::string> serializeDirTrees(
+	const DirTree &tree, const std::vector<long long> &dirBlocks,
+	const std::vector<int> &dirs, unsigned nThreads = 1);
+
+// Walk the directory tree to build a usage update JSON, which tells LotMan
 // about our current understanding of cache's disk usage.
-json reconstructPathsAndBuildJson(const XrdPfc::DataFsPurgeshot &purge_shot) {
-	std::unordered_map<int, DirNode> indexToDirNode;
-	std::vector<DirNode *> rootDirs;
-
-	for (size_t i = 0; i < purge_shot.m_dir_vec.size(); ++i) {
-		const auto &dir_entry = purge_shot.m_dir_vec[i];
-		DirNode &dirNode = indexToDirNode[i];
-		dirNode.path = dir_entry.m_dir_name;
-		if (dir_entry.m_parent != -1) {
-			dirNode.path = std::filesystem::path("/") /
-						   indexToDirNode[dir_entry.m_parent].path /
-						   dirNode.path;
-			indexToDirNode[dir_entry.m_parent].subDirs.push_back(&dirNode);
-			if (dir_entry.m_parent == 0) {
-				rootDirs.push_back(&dirNode);
-			}
-		}
+//
+// Subtrees are independent of one another, so with more than one thread they
+// are serialized in parallel. Subtrees much larger than their fair share are
+// split up further: the top directory is filled in up front and each of its
+// subdirectories becomes a task of its own. Every task writes into a slot that
+// was reserved ahead of time, so the result is in the same order as a serial
+// build.
+json reconstructPathsAndBuildJson(const DirTree &tree,
+								  const DataFsPurgeshot &purge_shot,
+								  unsigned nThreads = 1);
+
+// Sends serialized usage update batches from a thread of its own, so the next
+// batch can be serialized while LotMan applies the current one. At most
+// maxQueued batches wait to be sent; Push blocks until there's room. Once a
+// send fails, everything after it is dropped.
+class UsageUpdatePipeline {
+  public:
+	using SendFn = std::function<bool(const std::string &update,
+									  size_t numDirs)>;
+
+	explicit UsageUpdatePipeline(SendFn send, size_t maxQueued = 1);
+	~UsageUpdatePipeline();
+
+	// Queue a batch. Returns false if an earlier batch failed to send.
+	bool Push(std::string update, size_t numDirs);
+	// Wait for every queued batch to be sent. Returns whether all of them
+	// were.
+	bool Finish();
+	size_t NumBatches() const { return m_num_batches; }
+
+  private:
+	void run();
+
+	SendFn m_send;
+	size_t m_max_queued;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	std::deque<std::pair<std::string, size_t>> m_queue;
+	bool m_closed{false};
+	bool m_failed{false};
+	size_t m_num_batches{0};
+	std::thread m_thread;
+};
+
+// Fold candidate directories that live underneath another candidate into that
+// ancestor, so the cache only walks each subtree once. Byte targets of the
+// absorbed directories are added to the ancestor's target, capped at the
+// ancestor's total usage. Candidates are returned in their original order, and
+// any candidate not found in the tree is passed through untouched.
+std::vector<PurgeCandidate> collapseNestedCandidates(
+	const DirTree &tree, const DataFsPurgeshot &purge_shot,
+	const std::map<std::string, std::unique_ptr<PurgeDirCandidateStats>>
+		&candidates);
+
+// Learns how many bytes the cache really frees when asked to clear a directory.
+// Files may be open, already gone, or smaller than their blocks suggested, so
+// the cache can deliver more or less than requested. After each cycle the
+// plugin records its requests, and at the start of the next one compares them
+// against the new snapshot. The resulting efficiency estimates (freed bytes per
+// requested byte) are kept per directory and per lot, and are used to scale
+// later requests so the cache lands on the target in a single cycle.
+class PurgeEfficiencyTracker {
+  public:
+	// Efficiency estimates are clamped to this range so a single odd cycle
+	// can't make the plugin wildly over- or under-request
+	static constexpr double kMinEfficiency = 0.25;
+	static constexpr double kMaxEfficiency = 4.0;
+
+	struct RequestRecord {
+		std::string lotName;
+		long long requestedB;
+		long long usageBeforeB;
+	};
+
+	void RecordRequest(const std::string &dir, const std::string &lotName,
+					   long long requestedB, long long usageBeforeB);
+
+	// Compare the previous cycle's requests against the current usage of each
+	// directory (or a negative value if the directory is gone) and update the
+	// efficiency estimates from the directories that shrank. Pending requests
+	// are cleared afterwards.
+	void Reconcile(
+		const std::function<long long(const std::string &)> &currentUsageB);
+
+	// Best available efficiency estimate, preferring the directory's own
+	// history, then the lot's, and assuming the cache delivers exactly what
+	// it's asked for otherwise.
+	double GetEfficiency(const std::string &dir,
+						 const std::string &lotName) const;
+
+	// Scale the number of bytes the plugin wants freed from a directory into
+	// the number of bytes to ask the cache for, capped at the directory usage.
+	long long AdjustRequest(const std::string &dir, const std::string &lotName,
+							long long targetB, long long dirUsageB) const;
+
+	const std::map<std::string, RequestRecord> &GetPendingRequests() const {
+		return m_pending;
 	}
 
-	nlohmann::json allDirsJson = nlohmann::json::array();
-	for (const auto *rootDir : rootDirs) {
-		allDirsJson.push_back(dirNodeToJson(rootDir, purge_shot));
+	void Save(StateWriter &writer) const;
+	bool Load(StateReader &reader);
+
+  private:
+	std::map<std::string, RequestRecord> m_pending;
+	std::map<std::string, double> m_dir_efficiency;
+	std::map<std::string, double> m_lot_efficiency;
+};
+
+// What the plugin knows about a single lot. Lots rarely change, so this is
+// loaded from LotMan in one go and reused across purge cycles.
+struct LotInfo {
+	bool isRoot{false};
+	std::vector<std::string> parents;
+	std::vector<std::string> children;
+	// Paths registered to the lot itself, and whether each one covers its
+	// subdirectories
+	std::vector<std::pair<std::string, bool>> paths;
+	long long dedicatedB{0};
+	long long opportunisticB{0};
+	long long maxObjects{-1};
+};
+
+// A lot's usage as worked out from the purge shot
+struct LotUsage {
+	// Bytes and files in the directories that belong to the lot itself
+	long long selfB{0};
+	long long selfObjects{0};
+	// The same, plus everything in the lot's descendants
+	long long totalB{0};
+	long long totalObjects{0};
+};
+
+// A lot's usage as LotMan reports it, in bytes. The dedicated and
+// opportunistic parts are how much of the total counts against each quota.
+struct LotManUsage {
+	long long totalB{0};
+	long long dedicatedB{0};
+	long long opportunisticB{0};
+	long long numObjects{0};
+};
+
+// Work out every lot's usage from the purge shot rather than asking LotMan.
+// A directory belongs to the lot that registered it or, failing that, to the
+// lot with the closest recursive path above it, so a child lot's path takes
+// its directories away from the parent. As in LotMan, directories no lot claims
+// count towards the default lot. Owners are handed down the tree first, then
+// usage is added up in one pass from the leaves back to the root.
+std::map<std::string, LotUsage>
+aggregateLotUsage(const DirTree &tree, const DataFsPurgeshot &purge_shot,
+				  const std::map<std::string, LotInfo> &lots);
+
+// Group the top-level directories of the purge shot so that each lot only
+// gets usage from the directories of one group. Directories belong to lots as
+// in aggregateLotUsage, and those without a lot count towards the default lot,
+// as they do in LotMan. Keyed by top-level directory name; group numbers only
+// say which directories go together.
+std::unordered_map<std::string, size_t>
+groupTopLevelDirsByLot(const DirTree &tree,
+					   const std::map<std::string, LotInfo> &lots);
+
+// Every directory the lots have registered, as seen from the purge shot. Lot
+// directories nest and the purge shot's usage includes subdirectories, so a
+// parent lot's directory also counts the bytes of any child lot directory
+// inside it. Taking those out means every byte is credited to one directory
+// only, however many lots reach it.
+//
+// The index is built for one lot cache and then kept up to date across purge
+// shots. A directory is only looked up in the tree again if it moved, and how
+// lot directories nest is only worked out again if one of them appeared or
+// went away.
+class LotDirIndex {
+  public:
+	struct Entry {
+		// Normalized path
+		std::string path;
+		// Every lot that registered the directory, in name order
+		std::vector<std::string> owners;
+		// Where the directory is in the tree, or -1 if it isn't there
+		int idx{-1};
+		// The directory's usage less that of the closest lot directories
+		// below it
+		long long exclusiveB{0};
+		// Those closest lot directories, as positions in the index
+		std::vector<size_t> nested;
+	};
+
+	LotDirIndex() = default;
+	LotDirIndex(const DirTree &tree, const DataFsPurgeshot &purge_shot,
+				const std::map<std::string, LotInfo> &lots);
+
+	// Catch up with a new purge shot. Returns the lots owning a directory
+	// whose exclusive bytes changed, or that appeared or went away.
+	std::unordered_set<std::string> Update(const DirTree &tree,
+										   const DataFsPurgeshot &purge_shot);
+
+	// A lot directory that's in the tree, by normalized path, or nullptr
+	const Entry *Find(const std::string &dir) const;
+	// Number of lot directories that are in the tree
+	size_t Size() const;
+
+  private:
+	void findNesting(const DirTree &tree);
+
+	std::vector<Entry> m_entries;
+	std::unordered_map<std::string, size_t> m_by_path;
+};
+
+// Bytes a directory the cache was asked to purge gave up between two purge
+// shots, given its usage in each. A negative usage now means the directory is
+// gone, and all of it was freed. New writes hide whatever was freed from a
+// directory that didn't shrink, so it counts as having given up nothing.
+long long purgedBytes(long long usageBeforeB, long long usageNowB);
+
+// Keeps a short history of total usage samples across purge cycles so the
+// plugin can estimate how quickly the cache is filling up. Bytes the cache
+// purged are added back to later samples, so purges don't show up as negative
+// growth.
+class UsageTrend {
+  public:
+	UsageTrend(size_t maxSamples = 8) : m_max_samples{maxSamples} {}
+
+	void AddSample(time_t when, long long usageB);
+	void RecordPurge(long long purgedB) { m_purged_b += purgedB; }
+	// Remember the usage of a directory the cache is asked to purge, so that
+	// what it really gives up can be credited once the next purge shot is in
+	void RecordPurgeRequest(const std::string &dir, long long usageB);
+	// Credit what each directory asked for last cycle gave up, given its
+	// usage now (or a negative value if it's gone). Returns the bytes
+	// credited. Pending requests are cleared afterwards.
+	long long ReconcilePurges(
+		const std::function<long long(const std::string &)> &currentUsageB);
+	const std::map<std::string, long long> &GetPendingPurges() const {
+		return m_pending_purges;
 	}
+	void Clear();
+	size_t NumSamples() const { return m_samples.size(); }
 
-	return allDirsJson;
-}
-} // End of anonymous namespace
+	// Least-squares estimate of the fill rate, in bytes per second. Returns 0
+	// until at least two samples with distinct timestamps are available.
+	double GetFillRateBps() const;
 
-namespace XrdPfc {
+	// Project the usage `seconds` past the most recent sample, assuming the
+	// current fill rate holds.
+	long long ProjectUsageB(long long seconds) const;
 
-enum class PurgePolicy { PastDel, PastExp, PastOpp, PastDed, UnknownPolicy };
+	void Save(StateWriter &writer) const;
+	bool Load(StateReader &reader);
 
-struct PurgeDirCandidateStats {
-	PurgeDirCandidateStats() : dir_b_to_purge{0}, dir_b_remaining{0} {};
+  private:
+	size_t m_max_samples;
+	long long m_purged_b{0};
+	// Directories the cache was asked to purge, and their usage at the time
+	std::map<std::string, long long> m_pending_purges;
+	// Each sample stores the usage plus all bytes purged before it was taken
+	std::deque<std::pair<time_t, long long>> m_samples;
+};
 
-	PurgeDirCandidateStats(const long long toPurge, const long long remaining)
-		: dir_b_to_purge{toPurge}, dir_b_remaining{remaining} {};
+enum class LogLevel { Error, Warning, Info, Debug };
 
-	long long dir_b_to_purge;
-	long long dir_b_remaining;
+// Parse the `loglevel` option: error, warning, info or debug
+bool parseLogLevel(const std::string &value, LogLevel &result);
+
+// A list of lot names to log, either from LotMan or worked out by the plugin.
+// Only the first few are written out, followed by how many there were in
+// total.
+struct LogList {
+	static constexpr size_t kMaxItems = 8;
+	char **items{nullptr};
+	const std::vector<std::string> *names{nullptr};
 };
 
-std::string getPolicyName(PurgePolicy policy);
-PurgePolicy getPolicyFromConfigName(const std::string &name);
+// Log messages for the purge path. A message below the configured level costs
+// a single comparison: its arguments are never formatted. Enabled messages are
+// assembled in a buffer that's allocated once and reused, and anything longer
+// than the buffer is cut short rather than growing it.
+class PurgeLog {
+  public:
+	static constexpr size_t kBufferSize = 2048;
+
+	PurgeLog(XrdSysError *sink = nullptr) : m_sink{sink} {
+		m_buf.reserve(kBufferSize);
+	}
+
+	void SetSink(XrdSysError *sink) { m_sink = sink; }
+	void SetLevel(LogLevel level) { m_level = level; }
+	LogLevel GetLevel() const { return m_level; }
+	bool Enabled(LogLevel level) const { return level <= m_level; }
+
+	template <typename... Args>
+	void Log(LogLevel level, const char *func, const Args &...args) {
+		if (!Enabled(level)) {
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_buf.clear();
+		(Append(args), ...);
+		if (m_buf.size() == kBufferSize) {
+			m_buf.replace(kBufferSize - 3, 3, "...");
+		}
+		if (m_sink) {
+			m_sink->Emsg("XrdPurgeLotMan", func, m_buf.c_str());
+		}
+	}
+
+	// The most recently written message
+	const std::string &Last() const { return m_buf; }
+
+  private:
+	void Append(std::string_view text) {
+		m_buf.append(text.substr(0, kBufferSize - m_buf.size()));
+	}
+	void Append(const char *text) { Append(std::string_view(text)); }
+	void Append(double value);
+	void Append(PurgePolicy policy);
+	void Append(const LogList &list);
+	template <typename T>
+	std::enable_if_t<std::is_integral_v<T>> Append(T value) {
+		char digits[24];
+		auto result = std::to_chars(digits, digits + sizeof(digits), value);
+		Append(std::string_view(digits, result.ptr - digits));
+	}
+
+	XrdSysError *m_sink;
+	LogLevel m_level{LogLevel::Info};
+	std::mutex m_mutex;
+	std::string m_buf;
+};
 
 class XrdPurgeLotMan : public PurgePin {
 	XrdSysError *log;
@@ -125,87 +624,426 @@ class XrdPurgeLotMan : public PurgePin {
 	virtual long long GetBytesToRecover(const DataFsPurgeshot &) override;
 	virtual bool ConfigPurgePin(const char *params) override;
 
-	long long GetConfiguredHWM();
-	long long GetConfiguredLWM();
-	long long GetConfiguredFUsageBaseline();
-	long long GetConfiguredFUsageNominal();
-	long long GetConfiguredFUsageMax();
+	// Virtual so the watermarks can be supplied without a configured cache
+	virtual long long GetConfiguredHWM();
+	virtual long long GetConfiguredLWM();
+	virtual long long GetConfiguredFUsageBaseline();
+	virtual long long GetConfiguredFUsageNominal();
+	virtual long long GetConfiguredFUsageMax();
+	virtual long long GetConfiguredPurgeInterval();
+	// Virtual so tests can step the clock from one purge cycle to the next
+	virtual time_t GetCurrentTime();
+
+	// Whether the last purge cycle ran out of time before every policy was
+	// evaluated, in which case it returned only what it had found so far
+	bool WasLastCycleTruncated() const { return m_cycle_truncated; }
 
 	// Custom deleter for unique pointers in which LM allocates some memory
 	// Used to guarantee we call `lotman_free_string_list` on these pointers
 	struct LotDeleter;
 
+	using PolicyStageFn = void (XrdPurgeLotMan::*)(const DataFsPurgeshot &,
+												   long long &,
+												   const PolicyStageParams &);
+
+	// A kind of policy stage the plugin knows how to run, along with the name
+	// used to select it in the configuration
+	struct PolicyStageType {
+		const char *configName;
+		PurgePolicy policy;
+		PolicyStageFn run;
+		// Cheap to evaluate and only takes from lots that are past a limit,
+		// so it's run between the nominal and max file usage
+		bool light;
+	};
+
+	// One configured step of the purge pipeline. The function to run is
+	// resolved when the configuration is parsed, so each purge cycle just
+	// walks a flat list.
+	struct PolicyStage {
+		PurgePolicy policy;
+		PolicyStageParams params;
+		PolicyStageFn run;
+		const char *configName{""};
+		bool light{false};
+	};
+
+	// All the stage types the plugin supports. New policies only need an
+	// entry here and an implementation.
+	static const std::vector<PolicyStageType> &getPolicyStageTypes();
+	static PolicyStage makePolicyStage(PurgePolicy policy,
+									   const PolicyStageParams &params = {});
+
 	class LotManConfiguration {
 	  public:
 		LotManConfiguration() {}
 		LotManConfiguration(std::string lot_home,
 							std::vector<PurgePolicy> policy)
-			: m_lot_home(lot_home), m_policy{policy} {}
+			: m_lot_home(lot_home) {
+			SetPolicy(policy);
+		}
 
 		std::string GetLotHome() { return m_lot_home; }
 		void SetLotHome(std::string lot_home) { m_lot_home = lot_home; }
-		std::vector<PurgePolicy> GetPolicy() { return m_policy; }
-		void SetPolicy(std::vector<PurgePolicy> policy) { m_policy = policy; }
+		std::vector<PurgePolicy> GetPolicy() {
+			std::vector<PurgePolicy> policy;
+			for (const auto &stage : m_pipeline) {
+				policy.push_back(stage.policy);
+			}
+			return policy;
+		}
+		void SetPolicy(std::vector<PurgePolicy> policy) {
+			m_pipeline.clear();
+			for (const auto &p : policy) {
+				m_pipeline.push_back(makePolicyStage(p));
+			}
+		}
+		const std::vector<PolicyStage> &GetPipeline() { return m_pipeline; }
+		void SetPipeline(std::vector<PolicyStage> pipeline) {
+			m_pipeline = pipeline;
+		}
+		bool GetPredictive() { return m_predictive; }
+		void SetPredictive(bool predictive) { m_predictive = predictive; }
+		bool GetFeedback() { return m_feedback; }
+		void SetFeedback(bool feedback) { m_feedback = feedback; }
+		unsigned GetThreads() { return m_threads; }
+		void SetThreads(unsigned threads) { m_threads = threads; }
+		bool GetWarmStart() { return m_warm_start; }
+		void SetWarmStart(bool warmStart) { m_warm_start = warmStart; }
+		std::chrono::milliseconds GetLotCacheTTL() { return m_lot_cache_ttl; }
+		void SetLotCacheTTL(std::chrono::milliseconds ttl) {
+			m_lot_cache_ttl = ttl;
+		}
+		bool GetPersist() { return m_persist; }
+		void SetPersist(bool persist) { m_persist = persist; }
+		bool GetIncremental() { return m_incremental; }
+		void SetIncremental(bool incremental) { m_incremental = incremental; }
+		std::chrono::milliseconds GetResync() { return m_resync; }
+		void SetResync(std::chrono::milliseconds resync) { m_resync = resync; }
+		// Top-level directories, such as `/atlas`, that are tracked in a
+		// lot home of their own
+		const std::vector<std::pair<std::string, std::string>> &GetShards() {
+			return m_shards;
+		}
+		void AddShard(const std::string &prefix, const std::string &lotHome) {
+			m_shards.emplace_back(prefix, lotHome);
+		}
+		bool GetLocalUsage() { return m_local_usage; }
+		void SetLocalUsage(bool localUsage) { m_local_usage = localUsage; }
+		// Upper bound on the size of a single usage update sent to LotMan, or
+		// zero to send everything at once
+		long long GetUpdateBatchB() { return m_update_batch_b; }
+		void SetUpdateBatchB(long long batchB) { m_update_batch_b = batchB; }
+		std::chrono::milliseconds GetLotManSync() { return m_lotman_sync; }
+		void SetLotManSync(std::chrono::milliseconds interval) {
+			m_lotman_sync = interval;
+		}
+		LogLevel GetLogLevel() { return m_log_level; }
+		void SetLogLevel(LogLevel level) { m_log_level = level; }
+		std::chrono::milliseconds GetDeadline() { return m_deadline; }
+		void SetDeadline(std::chrono::milliseconds deadline) {
+			m_deadline = deadline;
+		}
+		bool GetGraduated() { return m_graduated; }
+		void SetGraduated(bool graduated) { m_graduated = graduated; }
+		long long GetNominalBudgetB() { return m_nominal_budget_b; }
+		void SetNominalBudgetB(long long budgetB) {
+			m_nominal_budget_b = budgetB;
+		}
 
 	  private:
 		std::string m_lot_home;
-		std::vector<PurgePolicy> m_policy;
+		std::vector<PolicyStage> m_pipeline;
+		// Start purging early when the usage trend says the max will be
+		// crossed before the next purge cycle
+		bool m_predictive{false};
+		// Scale requests by how much the cache actually freed last time
+		bool m_feedback{false};
+		// Threads used to build the usage update. Zero means one per core.
+		unsigned m_threads{1};
+		// Load and verify the lot cache while configuring, instead of on the
+		// first purge cycle
+		bool m_warm_start{false};
+		// How long the lot cache is trusted before it's reloaded
+		std::chrono::milliseconds m_lot_cache_ttl{std::chrono::minutes(5)};
+		// Checkpoint cross-cycle state to the lot home after every cycle and
+		// reload it on startup
+		bool m_persist{false};
+		// Only send LotMan the top-level directories of lots whose usage
+		// changed
+		bool m_incremental{false};
+		long long m_update_batch_b{0};
+		// How often incremental mode sends everything regardless
+		std::chrono::milliseconds m_resync{std::chrono::hours(1)};
+		// Work out lot usage from the purge shot instead of asking LotMan
+		bool m_local_usage{false};
+		// With local usage, how often LotMan is sent the usage update
+		std::chrono::milliseconds m_lotman_sync{std::chrono::minutes(10)};
+		LogLevel m_log_level{LogLevel::Info};
+		std::vector<std::pair<std::string, std::string>> m_shards;
+		// Wall-clock budget for a single GetBytesToRecover call. Zero means
+		// no limit.
+		std::chrono::milliseconds m_deadline{0};
+		// Between the nominal and max file usage, run just the light stages
+		// with a small budget rather than waiting for the max
+		bool m_graduated{false};
+		// The most those light stages claim per cycle. Zero means a tenth of
+		// the distance between the nominal and max.
+		long long m_nominal_budget_b{0};
 	};
 
-	static const std::map<PurgePolicy,
-						  void (XrdPurgeLotMan::*)(const DataFsPurgeshot &,
-												   long long &)> &
-	getPolicyFunctionMap() {
-		static const std::map<PurgePolicy,
-							  void (XrdPurgeLotMan::*)(const DataFsPurgeshot &,
-													   long long &)>
-			policyFunctionMap = {
-				{PurgePolicy::PastDel, &XrdPurgeLotMan::lotsPastDelPolicy},
-				{PurgePolicy::PastExp, &XrdPurgeLotMan::lotsPastExpPolicy},
-				{PurgePolicy::PastOpp, &XrdPurgeLotMan::lotsPastOppPolicy},
-				{PurgePolicy::PastDed, &XrdPurgeLotMan::lotsPastDedPolicy}};
-		return policyFunctionMap;
-	}
-
+	// Run each stage of the configured pipeline in order, stopping once
+	// enough bytes have been found or the cycle runs out of time. With
+	// lightOnly, stages that aren't light are skipped.
 	void applyPolicies(const DataFsPurgeshot &purge_shot,
-					   long long &bytesRemaining) {
-		for (const auto &policy : m_lotman_conf.GetPolicy()) {
-			auto it = getPolicyFunctionMap().find(policy);
-			if (it != getPolicyFunctionMap().end()) {
-				(this->*(it->second))(purge_shot, bytesRemaining);
-			}
-		}
-	}
+					   long long &bytesRemaining, bool lightOnly = false);
 
   protected:
 	std::string getLotHome() { return m_lotman_conf.GetLotHome(); }
 
 	std::map<std::string, std::unique_ptr<PurgeDirCandidateStats>> m_purge_dirs;
 	LotManConfiguration m_lotman_conf;
+	PurgeLog m_log;
+	UsageTrend m_usage_trend;
+	PurgeEfficiencyTracker m_purge_efficiency;
+	// Directory structure of the purge shot currently being evaluated
+	DirTree m_dir_tree;
+
+	// A lot's directories and the bytes each one can give up, as last worked
+	// out for the purge policies. They stay valid until a directory of the
+	// lot or of one of its descendants changes, or the lot cache is reloaded.
+	struct LotCandidates {
+		bool valid{false};
+		std::map<std::string, long long> dirs;
+	};
+
+	// A part of the namespace whose lots live in their own LotMan database.
+	// The first shard is the configured lot home, and holds every top-level
+	// directory not claimed by another shard.
+	struct Shard {
+		// Top-level directory name without the leading slash, empty for the
+		// first shard
+		std::string topLevelDir;
+		std::string lotHome;
+		// Lot hierarchy, paths and quotas, keyed by lot name
+		std::map<std::string, LotInfo> lotCache;
+		bool lotCacheLoaded{false};
+		std::chrono::steady_clock::time_point lotCacheLoadedAt;
+		// This cycle's lot usage, when it was worked out by the plugin
+		std::map<std::string, LotUsage> lotUsage;
+		bool lotUsageValid{false};
+		// This cycle's lot usage as fetched from LotMan, for the lots that
+		// have been asked about so far
+		std::map<std::string, LotManUsage> lotManUsage;
+		// The lot cache's directories, built once the cache is loaded and
+		// brought up to date with every purge shot after that
+		LotDirIndex lotDirIndex;
+		bool lotDirIndexBuilt{false};
+		// This cycle's groups of top-level directories that have to reach
+		// LotMan in the same update, from groupTopLevelDirsByLot
+		std::unordered_map<std::string, size_t> updateGroups;
+		// Candidates for each lot, kept across cycles and only worked out
+		// again once they're no longer valid
+		std::unordered_map<std::string, LotCandidates> lotCandidates;
+	};
+	std::vector<Shard> m_shards{1};
+	// LotMan's lot home is process-wide, so only one shard is talked to at a
+	// time. Everything that uses LotMan or the lot cache works on this one.
+	size_t m_active_shard{0};
+	// Which shard goes first when policies are applied, so no shard always
+	// has its lots purged ahead of the others
+	size_t m_shard_rotation{0};
+
+	Shard &activeShard() { return m_shards[m_active_shard]; }
+	// Point LotMan at a shard's lot home
+	bool activateShard(size_t idx);
+	// The shard a top-level directory of the cache belongs to
+	size_t findShard(std::string_view topLevelDir) const;
+
+	// Replace the lot cache with a fresh copy from LotMan. On failure, the
+	// previous cache is left untouched.
+	bool loadLotCache();
+	// Reload the lot cache if it's missing or older than its TTL
+	void refreshLotCache();
+	// Root lots, from the cache if it's loaded or straight from LotMan if not
+	std::vector<std::string> getRootLots();
+	// Paths tied to a lot and all of its descendants
+	std::vector<std::string> getLotDirs(const std::string &lot);
+	// Have the active shard's listed lots, and every lot above them, work out
+	// their candidates again
+	void invalidateLotCandidates(const std::unordered_set<std::string> &lots);
+	// How many lots had their candidates reused, or worked out, this cycle
+	size_t m_candidates_reused{0};
+	size_t m_candidates_computed{0};
+
+	// Ask LotMan for the usage of every listed lot that isn't in the active
+	// shard's LotMan usage table yet, one query per lot, and add it to the
+	// table. Each query asks for all of a lot's usage fields, and the table
+	// lasts for the rest of the cycle, so the total, policy stages and later
+	// stages reuse what was fetched instead of asking again. With
+	// stopAtDeadline, lots not reached before the cycle's deadline are left
+	// out.
+	void fetchLotUsage(const std::vector<std::string> &lots,
+					   bool stopAtDeadline = false);
+	// A lot's entry in the LotMan usage table, fetched if it isn't there yet,
+	// or nullptr if LotMan couldn't provide it
+	const LotManUsage *getLotManUsage(const std::string &lot);
+
+	// Fingerprint of the usage last sent to LotMan for each top-level
+	// directory, and when everything was last sent
+	std::map<std::string, uint64_t> m_sent_fingerprints;
+	time_t m_last_full_sync{0};
+
+	// Spawning threads isn't worth it for a small tree, so give each one at
+	// least a few thousand directories to serialize
+	static constexpr size_t kMinDirsPerThread = 4096;
+
+	// What a usage update is built from. The JSON is serialized from
+	// m_dir_tree as it's sent rather than all at once, so only the block
+	// counts have to be kept from the purge shot.
+	struct UsageUpdatePlan {
+		// Each shard's top-level directories, in m_dir_tree
+		std::vector<std::vector<int>> shardDirs;
+		std::vector<long long> dirBlocks;
+		unsigned nThreads{1};
+		bool fullSync{false};
+		time_t now{0};
+	};
+
+	// Send the active shard its part of the usage update, given its
+	// top-level directories. In incremental mode, top-level directories
+	// whose usage hasn't changed since they were last sent are left out
+	// unless this is a full sync. The fingerprint of every directory is
+	// added to `fingerprints`. With a batch size, the update goes out in
+	// batches of whole top-level directories, each no bigger than the batch
+	// size unless a single directory is.
+	bool sendUsageUpdate(const std::vector<int> &topDirs,
+						 const UsageUpdatePlan &plan,
+						 std::map<std::string, uint64_t> &fingerprints);
+	// Send every shard its part of the usage update, then remember what was
+	// sent for incremental mode
+	bool sendShardUpdates(const UsageUpdatePlan &plan);
+
+	// With local usage, LotMan is only brought up to date every so often, in
+	// the background between purge cycles. The next cycle waits for it before
+	// talking to LotMan itself.
+	std::thread m_usage_sync;
+	time_t m_last_lotman_sync{0};
+	void startUsageSync(UsageUpdatePlan plan);
+	void waitForUsageSync();
+
+	// Lots past a usage-based policy according to the active shard's local
+	// usage, along with all their descendants
+	std::vector<std::string> getLocalLotsPast(PurgePolicy policy);
+	// How many bytes a lot is over the limit checked by a usage-based policy,
+	// or a negative number if it's not over
+	long long getLotExcessB(const std::string &lotName, PurgePolicy policy);
+
+	static constexpr uint64_t kStateVersion = 2;
+	// A file of the plugin's own, directly under the lot home. LotMan's .lot
+	// directory is left alone: it only appears once LotMan has created its
+	// database there.
+	std::string getStateFilePath();
+	// Write the usage trend, purge feedback and sent fingerprints to the lot
+	// home, replacing any earlier checkpoint
+	bool saveState();
+	// Restore what saveState wrote. Anything missing, from another version or
+	// damaged is ignored and the plugin starts fresh.
+	bool loadState();
+
+	// The usage at which a purge starts and the usage it purges down to,
+	// preferring the file usage limits over the HWM/LWM. The nominal file
+	// usage is -1 when only the HWM/LWM are configured.
+	bool getPurgeLimits(long long &maxB, long long &baselineB,
+						long long &nominalB);
+	// The cycle proper, without any what-if evaluation
+	long long runPurgeCycle(const DataFsPurgeshot &purge_shot);
+
+	// What-if evaluation for capacity planning. An operator drops a request
+	// such as
+	//   {"hwm": "900g", "lwm": "700g", "policies": "del exp opp ded"}
+	// into the lot home's control file, and after the next purge cycle the
+	// policies are run against that cycle's purge shot with those limits.
+	// Anything left out of the request is taken from the configuration.
+	// Nothing is sent to LotMan, and the cache's purge list and the state
+	// carried into the next cycle are left alone. A cycle that stops before
+	// lot usage is up to date leaves the request for the next one.
+	// What would have been purged, and how long working it out took, are
+	// written to the result file, and the request is removed.
+	std::string getWhatIfPath();
+	std::string getWhatIfResultPath();
+	void runWhatIf(const DataFsPurgeshot &purge_shot);
+	json evaluateWhatIf(const json &request, const DataFsPurgeshot &purge_shot);
+
+	// Look up a directory's usage in the current purge shot by its full path
+	const DirUsage *findDirUsage(const DataFsPurgeshot &purge_shot,
+								 const std::string &path) const;
+
+	std::chrono::steady_clock::time_point m_cycle_deadline;
+	bool m_cycle_truncated{false};
+	// Whether the last purge cycle got as far as bringing every shard's lot
+	// usage up to date
+	bool m_cycle_usage_ready{false};
+
+	// Start the clock on the current purge cycle
+	void startCycleDeadline();
+	// Check whether the current purge cycle has used up its time. The first
+	// time this returns true, the cycle is marked as truncated.
+	bool deadlineExpired();
 
 	bool validateConfiguration(const char *params);
+	bool parseConfigOption(const std::string &option,
+						   LotManConfiguration &cfg);
+	bool parsePolicyStage(const std::string &token, PolicyStage &stage);
+
+	// Given the current usage and the configured limits, work out how many
+	// bytes to clear now so that the projected usage at the next purge cycle
+	// stays under the max.
+	long long getPredictedBytesToRecover(long long totalUsageB,
+										 long long HWMComparator,
+										 long long LWMComparator);
 
 	// indicates that these tend to clean out an entire lot, such as lots past
 	// deletion/expiration
 	void completePurgePolicyBase(const DataFsPurgeshot &purgeShot,
 								 long long &bytesRemaining, PurgePolicy policy);
 	// whereas these only purge some of the storage, such as lots past
-	// opportunistic/dedicated storage
+	// opportunistic/dedicated storage or their object quota
 	void partialPurgePolicyBase(const DataFsPurgeshot &purgeShot,
 								long long &bytesRemaining, PurgePolicy policy);
 
 	std::map<std::string, long long> getLotUsageMap(char ***lots);
 
+	// Claim up to maxB bytes from a candidate directory, returning how many
+	// were actually claimed
+	long long claimDirBytes(const std::string &dir, const std::string &lotName,
+							long long bytesInDir, long long maxB);
+	long long getLotMaxObjects(const std::string &lot);
+
 	// Policy implementations
-	void lotsPastDelPolicy(const DataFsPurgeshot &, long long &bytesToRecover);
-	void lotsPastExpPolicy(const DataFsPurgeshot &, long long &bytesRemaining);
+	void lotsPastDelPolicy(const DataFsPurgeshot &, long long &bytesToRecover,
+						   const PolicyStageParams &);
+	void lotsPastExpPolicy(const DataFsPurgeshot &, long long &bytesRemaining,
+						   const PolicyStageParams &);
 	void lotsPastOppPolicy(const DataFsPurgeshot &purgeShot,
-						   long long &bytesRemaining);
+						   long long &bytesRemaining,
+						   const PolicyStageParams &);
 	void lotsPastDedPolicy(const DataFsPurgeshot &purgeShot,
-						   long long &bytesRemaining);
+						   long long &bytesRemaining,
+						   const PolicyStageParams &);
+	void lotsPastObjPolicy(const DataFsPurgeshot &purgeShot,
+						   long long &bytesRemaining,
+						   const PolicyStageParams &);
+	// Clears whole directories from any lot, least recently used first and
+	// largest first among equally old directories
+	void sizeOrderedLRUPolicy(const DataFsPurgeshot &purgeShot,
+							  long long &bytesRemaining,
+							  const PolicyStageParams &params);
 
 	long long getTotalUsageB();
-	std::map<std::string, long long>
+	// A lot's purge candidates. The result stays valid until the lot's
+	// candidates are next worked out, which is never within a cycle.
+	const std::map<std::string, long long> &
 	lotPerDirUsageB(const std::string &lot, const DataFsPurgeshot &purge_shot);
 };
 
@@ -0,0 +1,92 @@
+#ifndef __XRDPURGELOTMANTRACE_HH__
+#define __XRDPURGELOTMANTRACE_HH__
+
+// Static tracepoints (USDT) under the "xrdlotman" provider, so bpftrace or perf
+// can be pointed at a live cache. They're compiled in only when the plugin is
+// built with XROOTD_PLUGINS_USDT, and even then each one is a nop behind an
+// untaken branch until a tracer attaches to it.
+//
+//   lotman_call(function, lot, rv, duration_ns)
+//   usage_update(lot_home, num_dirs, payload_bytes)
+//   stage_start(policy, lot_home, bytes_remaining)
+//   stage_done(policy, lot_home, bytes_claimed, duration_ns)
+//   dir_claim(lot, dir, bytes)
+//   cycle_done(bytes_to_recover, num_dirs, duration_ns)
+//
+// `lot` is empty for LotMan calls that aren't about a single lot.
+
+#include <chrono>
+
+#ifdef XRDLOTMAN_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+// A tracer bumps a probe's semaphore while it's attached, which is how the
+// plugin knows whether the probe's arguments are worth gathering
+#define XRDLOTMAN_SEMAPHORE(probe) xrdlotman_##probe##_semaphore
+#define XRDLOTMAN_DECLARE_SEMAPHORE(probe)                                     \
+	extern unsigned short XRDLOTMAN_SEMAPHORE(probe)                           \
+		__attribute__((section(".probes")))
+#define XRDLOTMAN_DEFINE_SEMAPHORE(probe)                                      \
+	unsigned short XRDLOTMAN_SEMAPHORE(probe)                                  \
+		__attribute__((section(".probes"))) = 0
+
+XRDLOTMAN_DECLARE_SEMAPHORE(lotman_call);
+XRDLOTMAN_DECLARE_SEMAPHORE(usage_update);
+XRDLOTMAN_DECLARE_SEMAPHORE(stage_start);
+XRDLOTMAN_DECLARE_SEMAPHORE(stage_done);
+XRDLOTMAN_DECLARE_SEMAPHORE(dir_claim);
+XRDLOTMAN_DECLARE_SEMAPHORE(cycle_done);
+
+#define XRDLOTMAN_PROBE_ENABLED(probe)                                         \
+	__builtin_expect(XRDLOTMAN_SEMAPHORE(probe) != 0, 0)
+#define XRDLOTMAN_PROBE(probe, ...) STAP_PROBEV(xrdlotman, probe, __VA_ARGS__)
+#else
+// The arguments are never evaluated, only kept from looking unused
+#define XRDLOTMAN_PROBE_ENABLED(probe) false
+#define XRDLOTMAN_PROBE(probe, ...)                                            \
+	do {                                                                       \
+		if (false) {                                                           \
+			XrdPfc::ignoreProbeArgs(__VA_ARGS__);                              \
+		}                                                                      \
+	} while (0)
+#endif
+
+// Start time for a probe's duration argument, only read from the clock if
+// something is listening
+#define XRDLOTMAN_PROBE_START(probe)                                           \
+	(XRDLOTMAN_PROBE_ENABLED(probe) ? std::chrono::steady_clock::now()         \
+									: std::chrono::steady_clock::time_point{})
+
+namespace XrdPfc {
+
+template <typename... Args> inline void ignoreProbeArgs(const Args &...) {}
+
+inline long long nanosecondsSince(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			   std::chrono::steady_clock::now() - start)
+		.count();
+}
+
+// Run a LotMan call, timing it for lotman_call if a tracer is listening
+template <typename Call>
+inline int tracedLotManCall(const char *function, const char *lot,
+							Call &&call) {
+	if (XRDLOTMAN_PROBE_ENABLED(lotman_call)) {
+		const auto start = std::chrono::steady_clock::now();
+		int rv = call();
+		XRDLOTMAN_PROBE(lotman_call, function, lot, rv,
+						nanosecondsSince(start));
+		return rv;
+	}
+	return call();
+}
+
+} // namespace XrdPfc
+
+// XRDLOTMAN_CALL(lot, lotman_fn, args...) calls lotman_fn(args...) through
+// tracedLotManCall
+#define XRDLOTMAN_CALL(lot, fn, ...)                                           \
+	XrdPfc::tracedLotManCall(#fn, lot, [&] { return fn(__VA_ARGS__); })
+
+#endif // __XRDPURGELOTMANTRACE_HH__
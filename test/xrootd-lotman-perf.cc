@@ -0,0 +1,355 @@
+#include "../src/XrdPurgeLotMan.hh"
+
+#include <XrdPfc/XrdPfc.hh>
+#include <lotman/lotman.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <filesystem>
+#include <fstream>
+#include <gtest/gtest.h>
+#include <new>
+#include <nlohmann/json.hpp>
+
+// Bytes the plugin currently holds on the heap, and the most it has held at
+// once since the high-water mark was last reset. Each allocation carries a
+// header with the size it was counted with, so frees always undo exactly
+// what was added. Allocations made inside LotMan are counted as zero bytes:
+// how much memory LotMan needs depends on its version and database, not on
+// the plugin.
+static std::atomic<long long> g_live_bytes{0};
+static std::atomic<long long> g_peak_live_bytes{0};
+static thread_local bool t_in_lotman{false};
+static constexpr size_t kAllocHeader = alignof(std::max_align_t);
+
+void *operator new(std::size_t size) {
+	void *block = std::malloc(size + kAllocHeader);
+	if (!block) {
+		throw std::bad_alloc();
+	}
+	const long long counted = t_in_lotman ? 0 : static_cast<long long>(size);
+	*static_cast<long long *>(block) = counted;
+	const long long live =
+		g_live_bytes.fetch_add(counted, std::memory_order_relaxed) + counted;
+	long long peak = g_peak_live_bytes.load(std::memory_order_relaxed);
+	while (live > peak && !g_peak_live_bytes.compare_exchange_weak(
+							  peak, live, std::memory_order_relaxed)) {
+	}
+	return static_cast<char *>(block) + kAllocHeader;
+}
+
+void *operator new[](std::size_t size) { return operator new(size); }
+
+void operator delete(void *ptr) noexcept {
+	if (!ptr) {
+		return;
+	}
+	void *block = static_cast<char *>(ptr) - kAllocHeader;
+	g_live_bytes.fetch_sub(*static_cast<long long *>(block),
+						   std::memory_order_relaxed);
+	std::free(block);
+}
+
+void operator delete[](void *ptr) noexcept { operator delete(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { operator delete(ptr); }
+
+void operator delete[](void *ptr, std::size_t) noexcept {
+	operator delete(ptr);
+}
+
+// Calls into LotMan, and the time spent in them. Each function the plugin uses
+// is interposed here and forwarded to the real library. In these scenarios
+// LotMan is only called from the thread running the purge cycle.
+static std::atomic<unsigned long long> g_lotman_calls{0};
+static std::atomic<long long> g_lotman_ns{0};
+
+#define LOTMAN_COUNTED(name, params, args)                                     \
+	extern "C" int name params {                                               \
+		static auto real =                                                     \
+			reinterpret_cast<int(*) params>(dlsym(RTLD_NEXT, #name));          \
+		g_lotman_calls.fetch_add(1, std::memory_order_relaxed);                \
+		const auto start = std::chrono::steady_clock::now();                   \
+		t_in_lotman = true;                                                    \
+		int rv = real args;                                                    \
+		t_in_lotman = false;                                                   \
+		g_lotman_ns.fetch_add(                                                 \
+			std::chrono::duration_cast<std::chrono::nanoseconds>(              \
+				std::chrono::steady_clock::now() - start)                      \
+				.count(),                                                      \
+			std::memory_order_relaxed);                                        \
+		return rv;                                                             \
+	}
+
+LOTMAN_COUNTED(lotman_set_context_str,
+			   (const char *key, const char *value, char **err_msg),
+			   (key, value, err_msg))
+LOTMAN_COUNTED(lotman_get_context_str,
+			   (const char *key, char **output, char **err_msg),
+			   (key, output, err_msg))
+LOTMAN_COUNTED(lotman_update_lot_usage_by_dir,
+			   (const char *update_JSON_str, bool delta_mode, char **err_msg),
+			   (update_JSON_str, delta_mode, err_msg))
+LOTMAN_COUNTED(lotman_get_lot_usage,
+			   (const char *usage_attributes_JSON_str, char **output,
+				char **err_msg),
+			   (usage_attributes_JSON_str, output, err_msg))
+LOTMAN_COUNTED(lotman_list_all_lots, (char ***output, char **err_msg),
+			   (output, err_msg))
+LOTMAN_COUNTED(lotman_is_root, (const char *lot_name, char **err_msg),
+			   (lot_name, err_msg))
+LOTMAN_COUNTED(lotman_get_parent_names,
+			   (const char *lot_name, const bool recursive,
+				const bool get_self, char ***output, char **err_msg),
+			   (lot_name, recursive, get_self, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lot_dirs,
+			   (const char *lot_name, const bool recursive, char **output,
+				char **err_msg),
+			   (lot_name, recursive, output, err_msg))
+LOTMAN_COUNTED(lotman_get_policy_attributes,
+			   (const char *policy_attributes_JSON_str, char **output,
+				char **err_msg),
+			   (policy_attributes_JSON_str, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lots_past_del,
+			   (const bool recursive, char ***output, char **err_msg),
+			   (recursive, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lots_past_exp,
+			   (const bool recursive, char ***output, char **err_msg),
+			   (recursive, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lots_past_opp,
+			   (const bool recursive_quota, const bool recursive_children,
+				char ***output, char **err_msg),
+			   (recursive_quota, recursive_children, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lots_past_ded,
+			   (const bool recursive_quota, const bool recursive_children,
+				char ***output, char **err_msg),
+			   (recursive_quota, recursive_children, output, err_msg))
+LOTMAN_COUNTED(lotman_get_lots_past_obj,
+			   (const bool recursive_quota, const bool recursive_children,
+				char ***output, char **err_msg),
+			   (recursive_quota, recursive_children, output, err_msg))
+
+#undef LOTMAN_COUNTED
+
+// What a single purge cycle cost the plugin itself, with the time spent in
+// LotMan taken out of the wall-clock time and reported on its own
+struct PerfSample {
+	double wallMs{0};
+	double lotmanMs{0};
+	long long peakLiveBytes{0};
+	unsigned long long lotmanCalls{0};
+};
+
+struct PerfScenario {
+	const char *name;
+	size_t numDirs;
+	size_t numLots;
+};
+
+static json g_baselines;
+static json g_tolerance;
+static json g_measured = json::object();
+
+// The plugin with its watermarks set directly instead of read from the cache's
+// configuration, and without a log sink since there's no cache to own one
+class XrdPurgeLotManPerf : public XrdPfc::XrdPurgeLotMan {
+  public:
+	XrdPurgeLotManPerf(long long hwm, long long lwm) : m_hwm{hwm}, m_lwm{lwm} {
+		m_log.SetSink(nullptr);
+	}
+
+	long long GetConfiguredHWM() override { return m_hwm; }
+	long long GetConfiguredLWM() override { return m_lwm; }
+	long long GetConfiguredFUsageBaseline() override { return 0; }
+	long long GetConfiguredFUsageNominal() override { return 0; }
+	long long GetConfiguredFUsageMax() override { return 0; }
+	long long GetConfiguredPurgeInterval() override { return 3600; }
+
+  private:
+	long long m_hwm;
+	long long m_lwm;
+};
+
+// Lay out a purge shot the way the cache does: the root first, then each
+// directory's daughters as one contiguous block somewhere after it. The root
+// holds one directory per lot and everything below those fans out breadth
+// first until there are numDirs directories.
+XrdPfc::DataFsPurgeshot buildPurgeShot(size_t numDirs, size_t numLots) {
+	constexpr size_t kFanout = 8;
+	XrdPfc::DataFsPurgeshot purgeShot;
+	auto &dirs = purgeShot.m_dir_vec;
+	dirs.resize(numDirs);
+
+	const time_t longAgo = time(nullptr) - 30 * 24 * 3600;
+	size_t next = 1;
+	for (size_t i = 0; i < numDirs; ++i) {
+		size_t numDaughters = std::min(i == 0 ? numLots : kFanout,
+									   numDirs - next);
+		dirs[i].m_daughters_begin = next;
+		dirs[i].m_daughters_end = next + numDaughters;
+		for (size_t j = 0; j < numDaughters; ++j) {
+			auto &daughter = dirs[next + j];
+			daughter.m_parent = i;
+			daughter.m_dir_name =
+				(i == 0 ? "lot" : "dir") + std::to_string(j);
+		}
+		next += numDaughters;
+
+		// A MiB and a few files in every directory, last touched a month ago
+		dirs[i].m_usage.m_StBlocks = 2048;
+		dirs[i].m_usage.m_NFiles = 4;
+		dirs[i].m_usage.m_LastOpenTime = longAgo;
+		dirs[i].m_usage.m_LastCloseTime = longAgo;
+	}
+
+	// Usage is recursive, and daughters always come after their parent
+	for (size_t i = numDirs; i-- > 1;) {
+		auto &parent = dirs[dirs[i].m_parent].m_usage;
+		parent.m_StBlocks += dirs[i].m_usage.m_StBlocks;
+		parent.m_NFiles += dirs[i].m_usage.m_NFiles;
+		parent.m_NDirectories += dirs[i].m_usage.m_NDirectories + 1;
+	}
+	return purgeShot;
+}
+
+class PurgeCyclePerfTest : public ::testing::TestWithParam<PerfScenario> {
+  protected:
+	std::string m_lot_home;
+
+	void SetUp() override {
+		char lotHome[] = "/tmp/purge_pin_perf_XXXXXX";
+		ASSERT_NE(mkdtemp(lotHome), nullptr) << strerror(errno);
+		m_lot_home = lotHome;
+
+		char *err;
+		ASSERT_EQ(lotman_set_context_str("lot_home", lotHome, &err), 0) << err;
+		ASSERT_EQ(lotman_set_context_str("caller", "owner1", &err), 0) << err;
+
+		// Every lot is well past its quotas, so the policies have work to do
+		auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+					   std::chrono::system_clock::now().time_since_epoch())
+					   .count();
+		auto addLot = [&](const std::string &lotName) {
+			json lot = {{"lot_name", lotName},
+						{"owner", "owner1"},
+						{"parents", {lotName}},
+						{"paths", {{{"path", "/" + lotName},
+									{"recursive", true}}}},
+						{"management_policy_attrs",
+						 {{"dedicated_GB", 0.0001},
+						  {"opportunistic_GB", 0.0001},
+						  {"max_num_objects", 100},
+						  {"creation_time", now},
+						  {"expiration_time", now + 3600000},
+						  {"deletion_time", now + 7200000}}}};
+			std::string lotStr = lot.dump();
+			char *err;
+			ASSERT_EQ(lotman_add_lot(lotStr.c_str(), &err), 0) << err;
+		};
+		addLot("default");
+		for (size_t i = 0; i < GetParam().numLots; ++i) {
+			addLot("lot" + std::to_string(i));
+		}
+	}
+
+	void TearDown() override { std::filesystem::remove_all(m_lot_home); }
+
+	static PerfSample measureCycle(XrdPurgeLotManPerf &purgePin,
+								   const XrdPfc::DataFsPurgeshot &purgeShot,
+								   long long &bytesToRecover) {
+		PerfSample sample;
+		const auto lotmanCalls = g_lotman_calls.load();
+		const auto lotmanNs = g_lotman_ns.load();
+		const long long liveBytes = g_live_bytes.load();
+		g_peak_live_bytes.store(liveBytes);
+		const auto start = std::chrono::steady_clock::now();
+		bytesToRecover = purgePin.GetBytesToRecover(purgeShot);
+		const auto end = std::chrono::steady_clock::now();
+		sample.lotmanMs = (g_lotman_ns.load() - lotmanNs) / 1e6;
+		sample.wallMs =
+			std::chrono::duration<double, std::milli>(end - start).count() -
+			sample.lotmanMs;
+		sample.peakLiveBytes = g_peak_live_bytes.load() - liveBytes;
+		sample.lotmanCalls = g_lotman_calls.load() - lotmanCalls;
+		return sample;
+	}
+};
+
+TEST_P(PurgeCyclePerfTest, StaysWithinBaseline) {
+	const PerfScenario &scenario = GetParam();
+	auto purgeShot = buildPurgeShot(scenario.numDirs, scenario.numLots);
+	const long long usageB = purgeShot.m_dir_vec[0].m_usage.m_StBlocks * 512;
+
+	// Over the high watermark, with half of everything to recover
+	XrdPurgeLotManPerf purgePin{1, usageB / 2};
+	ASSERT_TRUE(purgePin.ConfigPurgePin(m_lot_home.c_str()));
+
+	// The first cycle loads the lot cache; the steady state is what every
+	// purge interval pays for
+	long long bytesToRecover;
+	measureCycle(purgePin, purgeShot, bytesToRecover);
+	ASSERT_GT(bytesToRecover, 0);
+	PerfSample sample = measureCycle(purgePin, purgeShot, bytesToRecover);
+	ASSERT_GT(bytesToRecover, 0);
+	EXPECT_FALSE(purgePin.refDirInfos().empty());
+
+	std::cout << "[ PERF     ] " << scenario.name << ": " << sample.wallMs
+			  << " ms in the plugin, " << sample.lotmanMs << " ms in "
+			  << sample.lotmanCalls << " LotMan calls, "
+			  << sample.peakLiveBytes << " bytes peak live heap" << std::endl;
+	g_measured[scenario.name] = {{"wall_ms", sample.wallMs},
+								 {"peak_live_bytes", sample.peakLiveBytes},
+								 {"lotman_calls", sample.lotmanCalls}};
+
+	ASSERT_TRUE(g_baselines.contains(scenario.name))
+		<< "No baseline for " << scenario.name;
+	const json &baseline = g_baselines[scenario.name];
+	auto ceiling = [&](const char *metric) {
+		return baseline[metric].get<double>() *
+			   (1.0 + g_tolerance[metric].get<double>());
+	};
+	EXPECT_LE(sample.wallMs,
+			  ceiling("wall_ms") + g_tolerance["wall_ms_slack"].get<double>());
+	EXPECT_LE(sample.peakLiveBytes, ceiling("peak_live_bytes"));
+	EXPECT_LE(sample.lotmanCalls, ceiling("lotman_calls"));
+}
+
+INSTANTIATE_TEST_SUITE_P(
+	Scales, PurgeCyclePerfTest,
+	::testing::Values(PerfScenario{"dirs1k_lots10", 1000, 10},
+					  PerfScenario{"dirs100k_lots10", 100000, 10},
+					  PerfScenario{"dirs100k_lots1k", 100000, 1000},
+					  PerfScenario{"dirs1m_lots10k", 1000000, 10000}),
+	[](const ::testing::TestParamInfo<PerfScenario> &info) {
+		return std::string(info.param.name);
+	});
+
+// Baselines are what was measured on a reference build and live next to this
+// file, along with how far above them a run may land before it fails. Setting
+// XRDLOTMAN_PERF_RECORD to a path also writes what was measured there, in the
+// same layout, for recording new baselines.
+int main(int argc, char **argv) {
+	::testing::InitGoogleTest(&argc, argv);
+
+	std::ifstream baselineFile(XRDLOTMAN_PERF_BASELINES);
+	if (!baselineFile) {
+		std::cerr << "Could not open " << XRDLOTMAN_PERF_BASELINES
+				  << std::endl;
+		return 1;
+	}
+	const json baselines = json::parse(baselineFile);
+	g_baselines = baselines["scenarios"];
+	g_tolerance = baselines["tolerance"];
+
+	int rv = RUN_ALL_TESTS();
+
+	if (const char *recordPath = std::getenv("XRDLOTMAN_PERF_RECORD")) {
+		std::ofstream(recordPath)
+			<< json{{"tolerance", g_tolerance}, {"scenarios", g_measured}}
+				   .dump(4)
+			<< std::endl;
+	}
+	return rv;
+}
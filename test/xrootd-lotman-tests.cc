@@ -5,8 +5,10 @@
 
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <nlohmann/json.hpp>
+#include <thread>
 
 class LMSetupTeardown : public ::testing::Test {
   protected:
@@ -48,6 +50,18 @@ class LMSetupTeardown : public ::testing::Test {
 	}
 
 	static void TearDownTestSuite() { std::filesystem::remove_all(tmp_dir); }
+
+	// Tests that moved LotMan to a lot home of their own are moved back
+	void TearDown() override {
+		char *err;
+		ASSERT_EQ(lotman_set_context_str("lot_home", tmp_dir.c_str(), &err), 0)
+			<< err;
+	}
+
+	// A fresh lot home under the suite's, holding only the default lot, for
+	// tests that need exact usage totals. LotMan points at it until the test
+	// ends.
+	static std::string createLotHome(const std::string &name);
 };
 
 std::string LMSetupTeardown::tmp_dir;
@@ -60,6 +74,121 @@ class XrdPurgeLotManTest : public XrdPfc::XrdPurgeLotMan {
 
 	long long testGetTotalUsageB() { return getTotalUsageB(); }
 	LotManConfiguration testGetLotmanConf() { return m_lotman_conf; }
+	const std::map<std::string, XrdPfc::LotInfo> &testGetLotCache() {
+		return activeShard().lotCache;
+	}
+	XrdPfc::UsageTrend &testGetUsageTrend() { return m_usage_trend; }
+	bool testSaveState() { return saveState(); }
+	size_t testFindShard(const std::string &dir) { return findShard(dir); }
+	const std::map<std::string, XrdPfc::LotManUsage> &
+	testFetchLotUsage(const std::vector<std::string> &lots) {
+		fetchLotUsage(lots);
+		return activeShard().lotManUsage;
+	}
+	std::string testGetWhatIfPath() { return getWhatIfPath(); }
+	size_t testCandidatesReused() { return m_candidates_reused; }
+	size_t testCandidatesComputed() { return m_candidates_computed; }
+	const std::map<std::string, XrdPfc::LotUsage> &testGetLocalUsage() {
+		return activeShard().lotUsage;
+	}
+	void testRunWhatIf(const XrdPfc::DataFsPurgeshot &purge_shot) {
+		m_dir_tree = XrdPfc::DirTree(purge_shot);
+		runWhatIf(purge_shot);
+	}
+	// What a purge cycle leaves behind for the next one: the cached
+	// candidates and usage of every shard, and the shard LotMan points at
+	json testCycleState() {
+		json state;
+		char *lotHome;
+		char *err;
+		if (lotman_get_context_str("lot_home", &lotHome, &err) == 0) {
+			state["lot_home"] = lotHome;
+			free(lotHome);
+		}
+		state["active_shard"] = m_active_shard;
+		state["shards"] = json::array();
+		for (const auto &shard : m_shards) {
+			json candidates = json::object();
+			for (const auto &[lot, lotCandidates] : shard.lotCandidates) {
+				candidates[lot] = lotCandidates.dirs;
+			}
+			json lotManUsage = json::object();
+			for (const auto &[lot, usage] : shard.lotManUsage) {
+				lotManUsage[lot] = usage.totalB;
+			}
+			state["shards"].push_back(
+				{{"candidates", candidates}, {"lotman_usage", lotManUsage}});
+		}
+		return state;
+	}
+};
+
+// Watermarks, purge interval and clock set directly so whole purge cycles can
+// be run. Unless a test changes them, the watermarks are low enough for every
+// cycle to purge and the clock is the real one. The slow pipeline has two
+// stages that claim a fixed directory each; the first one takes its time, so a
+// short deadline runs out before the second gets to go.
+class XrdPurgeLotManCycleTest : public XrdPurgeLotManTest {
+  public:
+	long long GetConfiguredHWM() override { return m_hwm; }
+	long long GetConfiguredLWM() override { return m_lwm; }
+	long long GetConfiguredFUsageBaseline() override { return 0; }
+	long long GetConfiguredFUsageNominal() override { return 0; }
+	long long GetConfiguredFUsageMax() override { return 0; }
+	long long GetConfiguredPurgeInterval() override { return 100; }
+	time_t GetCurrentTime() override {
+		return m_now ? m_now : XrdPurgeLotManTest::GetCurrentTime();
+	}
+
+	long long m_hwm{1};
+	long long m_lwm{1};
+	time_t m_now{0};
+
+	// A single stage that claims a fixed number of bytes from each directory
+	void useFixedPipeline(std::map<std::string, long long> claims) {
+		m_fixed_claims = std::move(claims);
+		m_lotman_conf.SetPipeline(
+			{{XrdPfc::PurgePolicy::PastDel, {},
+			  static_cast<PolicyStageFn>(
+				  &XrdPurgeLotManCycleTest::fixedStage),
+			  "fixed"}});
+	}
+
+	void useSlowPipeline() {
+		m_lotman_conf.SetPipeline(
+			{{XrdPfc::PurgePolicy::PastDel, {},
+			  static_cast<PolicyStageFn>(
+				  &XrdPurgeLotManCycleTest::slowStage),
+			  "slow"},
+			 {XrdPfc::PurgePolicy::PastExp, {},
+			  static_cast<PolicyStageFn>(
+				  &XrdPurgeLotManCycleTest::fastStage),
+			  "fast"}});
+	}
+
+  private:
+	std::map<std::string, long long> m_fixed_claims;
+
+	void fixedStage(const XrdPfc::DataFsPurgeshot &, long long &bytesRemaining,
+					const XrdPfc::PolicyStageParams &) {
+		for (const auto &[dir, claimB] : m_fixed_claims) {
+			bytesRemaining -=
+				claimDirBytes(dir, "default", claimB, bytesRemaining);
+		}
+	}
+	void slowStage(const XrdPfc::DataFsPurgeshot &, long long &bytesRemaining,
+				   const XrdPfc::PolicyStageParams &) {
+		bytesRemaining -=
+			claimDirBytes("/deadline1", "default", 1024, bytesRemaining);
+		while (m_lotman_conf.GetDeadline().count() > 0 && !deadlineExpired()) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+	void fastStage(const XrdPfc::DataFsPurgeshot &, long long &bytesRemaining,
+				   const XrdPfc::PolicyStageParams &) {
+		bytesRemaining -=
+			claimDirBytes("/deadline2", "default", 1024, bytesRemaining);
+	}
 };
 
 void populatePurgeElement(XrdPfc::DirPurgeElement &element,
@@ -88,7 +217,36 @@ json createLotJSON(const std::string &lot_name, const std::string &owner,
 			  {"deletion_time", deletion_time}}}};
 }
 
+// Lots live in the lot home shared by the whole suite, so tests that run a
+// purge cycle add the ones they need unless an earlier test already did
+void addLotIfMissing(const json &lot) {
+	char *err;
+	const std::string lotName = lot["lot_name"];
+	if (lotman_lot_exists(lotName.c_str(), &err) == 1) {
+		return;
+	}
+	const std::string lotStr = lot.dump();
+	ASSERT_EQ(lotman_add_lot(lotStr.c_str(), &err), 0) << err;
+}
+
+std::string LMSetupTeardown::createLotHome(const std::string &name) {
+	const std::string lotHome = tmp_dir + "/" + name;
+	std::filesystem::create_directory(lotHome);
+	char *err;
+	if (lotman_set_context_str("lot_home", lotHome.c_str(), &err) != 0) {
+		ADD_FAILURE() << "Error setting lot_home: " << err;
+		return lotHome;
+	}
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+	return lotHome;
+}
+
 // Test cases for convertListToString function
+
 TEST(ConvertListToStringTest, HandlesEmptyArray) {
 	char *arr[] = {nullptr};
 	std::string result = convertListToString(arr);
@@ -113,30 +271,10 @@ TEST(ConvertListToStringTest, HandlesNullPointer) {
 	EXPECT_EQ(result, "");
 }
 
-TEST(DirNodeToJsonTest, ConstructsJsonForEmptyDirs) {
-	// To test the full functionality of this in a way that also reports
-	// directory sizes, I'd need to mock XrdPfc::DataFsPurgeshot, which has a
-	// non-overridable function for getting the size of a directory. This also
-	// requires real directories. Since I'm not testing the underlying
-	// XrdPfc::DataFsPurgeshot functionality, I'll just test the JSON conversion
-	// here.
-
-	// DirNode is one of the plugin's structs to act as an intermediary between
-	// the DataFsFPurgeshot class, the DirPurgeElement class, and the JSON
-	// object that LotMan uses to update lot usage.
-	DirNode subNode1;
-	subNode1.path = "/path/to/dir/subdir1";
-	DirNode subNode2;
-	subNode2.path = "/path/to/dir/subdir2";
-	DirNode subNode3;
-	subNode3.path = "/path/to/dir/subdir2/subdir3";
-
-	// Create main node and populate it with sub-nodes
-	DirNode node;
-	node.path = "/path/to/dir";
-	node.subDirs.push_back(&subNode1);
-	node.subDirs.push_back(&subNode2);
-	subNode2.subDirs.push_back(&subNode3);
+TEST(DirTreeToJsonTest, ConstructsJsonForEmptyDirs) {
+	// DirTree is one of the plugin's structures to act as an intermediary
+	// between the DataFsFPurgeshot class, the DirPurgeElement class, and the
+	// JSON object that LotMan uses to update lot usage.
 
 	// The purge shot holds DirPurgeElements, where each element specifies the
 	// name of the dir (_not_ the complete path), and which indices in the purge
@@ -146,14 +284,15 @@ TEST(DirNodeToJsonTest, ConstructsJsonForEmptyDirs) {
 	populatePurgeElement(rootElement, "dir", -1, 1, 3);
 	populatePurgeElement(subElement1, "subdir1", 0, 0, 0);
 	populatePurgeElement(subElement2, "subdir2", 0, 3, 4);
-	populatePurgeElement(subElement3, "subdir3", 3, 0, 0);
+	populatePurgeElement(subElement3, "subdir3", 2, 0, 0);
 
 	purge_shot.m_dir_vec.push_back(rootElement);
 	purge_shot.m_dir_vec.push_back(subElement1);
 	purge_shot.m_dir_vec.push_back(subElement2);
 	purge_shot.m_dir_vec.push_back(subElement3);
 
-	json result = dirNodeToJson(&node, purge_shot);
+	XrdPfc::DirTree tree(purge_shot);
+	json result = XrdPfc::dirTreeToJson(tree, 0, purge_shot);
 
 	// Validatation
 	EXPECT_EQ(result["path"], "dir");
@@ -171,6 +310,56 @@ TEST(DirNodeToJsonTest, ConstructsJsonForEmptyDirs) {
 	EXPECT_EQ(result["subdirs"][1]["subdirs"][0]["size_GB"], 0.0);
 }
 
+TEST(DirTreeTest, ResolvesPaths) {
+	XrdPfc::DataFsPurgeshot purge_shot;
+	XrdPfc::DirPurgeElement rootElement, aElement, bElement, aDataElement,
+		bDataElement, deepElement;
+	populatePurgeElement(rootElement, "", -1, 1, 3);
+	populatePurgeElement(aElement, "a", 0, 3, 4);
+	populatePurgeElement(bElement, "b", 0, 4, 5);
+	populatePurgeElement(aDataElement, "data", 1, 5, 6);
+	populatePurgeElement(bDataElement, "data", 2, 0, 0);
+	populatePurgeElement(deepElement, "deep", 3, 0, 0);
+	purge_shot.m_dir_vec = {rootElement, aElement, bElement,
+							aDataElement, bDataElement, deepElement};
+
+	XrdPfc::DirTree tree(purge_shot);
+	ASSERT_EQ(tree.Size(), 6);
+	EXPECT_EQ(tree.Path(0), "/");
+	EXPECT_EQ(tree.Path(4), "/b/data");
+	EXPECT_EQ(tree.Path(5), "/a/data/deep");
+	EXPECT_EQ(tree.Name(3), "data");
+	EXPECT_EQ(tree.Depth(5), 3);
+	EXPECT_EQ(tree.NumChildren(0), 2);
+	EXPECT_EQ(tree.NumChildren(4), 0);
+
+	// Repeated names share the same storage
+	EXPECT_EQ(tree.Name(3).data(), tree.Name(4).data());
+
+	EXPECT_EQ(tree.Find("/"), 0);
+	EXPECT_EQ(tree.Find("/a/data"), 3);
+	EXPECT_EQ(tree.Find("/a//data/deep/"), 5);
+	EXPECT_EQ(tree.Find("/b/deep"), -1);
+	EXPECT_EQ(tree.Find("a/data"), -1);
+
+	// Walking materializes each full path in depth-first order
+	std::vector<std::string> paths;
+	for (auto it = tree.Walk(); !it.Done(); it.Next()) {
+		EXPECT_EQ(it.Path(), tree.Path(it.Index()));
+		paths.push_back(it.Path());
+	}
+	EXPECT_EQ(paths, std::vector<std::string>({"/", "/a", "/a/data",
+											   "/a/data/deep", "/b",
+											   "/b/data"}));
+
+	paths.clear();
+	for (auto it = tree.Walk(1); !it.Done(); it.Next()) {
+		paths.push_back(it.Path());
+	}
+	EXPECT_EQ(paths, std::vector<std::string>(
+						 {"/a", "/a/data", "/a/data/deep"}));
+}
+
 TEST(reconstructPathsAndBuildJson, TypicalCase) {
 	// Given a constructed DataFsPurgeshot, reconstruct the paths and build a
 	// JSON object.
@@ -196,7 +385,8 @@ TEST(reconstructPathsAndBuildJson, TypicalCase) {
 	purge_shot.m_dir_vec.push_back(subElement2);
 	purge_shot.m_dir_vec.push_back(subElement3);
 
-	json result = reconstructPathsAndBuildJson(purge_shot);
+	XrdPfc::DirTree tree(purge_shot);
+	json result = XrdPfc::reconstructPathsAndBuildJson(tree, purge_shot);
 
 	// Validation
 	EXPECT_EQ(result.size(), 1);
@@ -215,6 +405,443 @@ TEST(reconstructPathsAndBuildJson, TypicalCase) {
 	EXPECT_EQ(result[0]["subdirs"][1]["subdirs"][0]["size_GB"], 0.0);
 }
 
+TEST(AggregateLotUsageTest, AssignsDirectoriesToLots) {
+	// /a belongs to lot1, except for /a/y which is its child lot2's. Only the
+	// files directly in /b belong to lot3, because its path isn't recursive.
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(7);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "a", 0, 3, 5);
+	populatePurgeElement(elements[2], "b", 0, 6, 7);
+	populatePurgeElement(elements[3], "x", 1, 0, 0);
+	populatePurgeElement(elements[4], "y", 1, 5, 6);
+	populatePurgeElement(elements[5], "z", 4, 0, 0);
+	populatePurgeElement(elements[6], "c", 2, 0, 0);
+	// Usage includes subdirectories. The root holds 5 blocks of its own.
+	std::vector<long long> blocks = {120, 60, 55, 10, 30, 20, 15};
+	std::vector<int> files = {12, 7, 5, 1, 4, 3, 2};
+	for (size_t i = 0; i < elements.size(); ++i) {
+		elements[i].m_usage.m_StBlocks = blocks[i];
+		elements[i].m_usage.m_NFiles = files[i];
+	}
+	purge_shot.m_dir_vec = elements;
+	XrdPfc::DirTree tree(purge_shot);
+
+	std::map<std::string, XrdPfc::LotInfo> lots;
+	lots["lot1"].isRoot = true;
+	lots["lot1"].paths = {{"/a", true}};
+	lots["lot1"].children = {"lot2"};
+	lots["lot2"].parents = {"lot1"};
+	lots["lot2"].paths = {{"/a/y", true}};
+	lots["lot3"].isRoot = true;
+	lots["lot3"].paths = {{"/b", false}};
+	lots["lot4"].isRoot = true;
+	lots["lot4"].paths = {{"/not/in/cache", true}};
+	lots["default"].isRoot = true;
+	lots["default"].paths = {{"/default", true}};
+
+	auto usage = XrdPfc::aggregateLotUsage(tree, purge_shot, lots);
+	ASSERT_EQ(usage.size(), 5);
+	// /a itself holds 60 - 10 - 30 blocks, plus /a/x
+	EXPECT_EQ(usage["lot1"].selfB, (20 + 10) * BLKSZ);
+	EXPECT_EQ(usage["lot1"].totalB, 60 * BLKSZ);
+	EXPECT_EQ(usage["lot1"].selfObjects, 2 + 1);
+	EXPECT_EQ(usage["lot1"].totalObjects, 7);
+	EXPECT_EQ(usage["lot2"].selfB, 30 * BLKSZ);
+	EXPECT_EQ(usage["lot2"].totalB, 30 * BLKSZ);
+	EXPECT_EQ(usage["lot3"].selfB, 40 * BLKSZ);
+	EXPECT_EQ(usage["lot3"].totalObjects, 3);
+	EXPECT_EQ(usage["lot4"].totalB, 0);
+	// Nothing claims /b/c, so it's the default lot's. The root's own files
+	// aren't any lot's.
+	EXPECT_EQ(usage["default"].totalB, 15 * BLKSZ);
+	EXPECT_EQ(usage["default"].totalObjects, 2);
+}
+
+TEST(GroupTopLevelDirsByLotTest, KeepsEachLotInOneGroup) {
+	// lot1 spans /a and /c. /d and /e itself belong to no lot, so both count
+	// towards the default lot, even though /e/y is lot3's. lot2 has /b and
+	// everything below it to itself.
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(8);
+	populatePurgeElement(elements[0], "", -1, 1, 6);
+	populatePurgeElement(elements[1], "a", 0, 0, 0);
+	populatePurgeElement(elements[2], "b", 0, 6, 7);
+	populatePurgeElement(elements[3], "c", 0, 0, 0);
+	populatePurgeElement(elements[4], "d", 0, 0, 0);
+	populatePurgeElement(elements[5], "e", 0, 7, 8);
+	populatePurgeElement(elements[6], "x", 2, 0, 0);
+	populatePurgeElement(elements[7], "y", 5, 0, 0);
+	purge_shot.m_dir_vec = elements;
+	XrdPfc::DirTree tree(purge_shot);
+
+	std::map<std::string, XrdPfc::LotInfo> lots;
+	lots["lot1"].paths = {{"/a", true}, {"/c", true}};
+	lots["lot2"].paths = {{"/b", true}};
+	lots["lot3"].paths = {{"/e/y", true}};
+
+	auto groups = XrdPfc::groupTopLevelDirsByLot(tree, lots);
+	ASSERT_EQ(groups.size(), 5);
+	EXPECT_EQ(groups["a"], groups["c"]);
+	EXPECT_EQ(groups["d"], groups["e"]);
+	EXPECT_NE(groups["a"], groups["b"]);
+	EXPECT_NE(groups["a"], groups["d"]);
+	EXPECT_NE(groups["b"], groups["d"]);
+}
+
+TEST(LotDirIndexTest, CreditsNestedLotDirsOnce) {
+	// lot1 owns /a and its child lot2 owns /a/y, so /a's usage also counts
+	// /a/y's. lot3 and lot4 both registered /b.
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(7);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "a", 0, 3, 5);
+	populatePurgeElement(elements[2], "b", 0, 6, 7);
+	populatePurgeElement(elements[3], "x", 1, 0, 0);
+	populatePurgeElement(elements[4], "y", 1, 5, 6);
+	populatePurgeElement(elements[5], "z", 4, 0, 0);
+	populatePurgeElement(elements[6], "c", 2, 0, 0);
+	std::vector<long long> blocks = {115, 60, 55, 10, 30, 20, 15};
+	for (size_t i = 0; i < elements.size(); ++i) {
+		elements[i].m_usage.m_StBlocks = blocks[i];
+	}
+	purge_shot.m_dir_vec = elements;
+	XrdPfc::DirTree tree(purge_shot);
+
+	std::map<std::string, XrdPfc::LotInfo> lots;
+	lots["lot1"].paths = {{"/a/", true}};
+	lots["lot1"].children = {"lot2"};
+	lots["lot2"].parents = {"lot1"};
+	lots["lot2"].paths = {{"/a/y", true}, {"/a/y/z", true}};
+	lots["lot3"].paths = {{"/b", true}};
+	lots["lot4"].paths = {{"/b", false}, {"/not/in/cache", true}};
+
+	XrdPfc::LotDirIndex index(tree, purge_shot, lots);
+	ASSERT_EQ(index.Size(), 4);
+	EXPECT_EQ(index.Find("/not/in/cache"), nullptr);
+	EXPECT_EQ(index.Find("/a")->exclusiveB, (60 - 30) * BLKSZ);
+	EXPECT_EQ(index.Find("/a")->owners, std::vector<std::string>{"lot1"});
+	EXPECT_EQ(index.Find("/a/y")->exclusiveB, (30 - 20) * BLKSZ);
+	EXPECT_EQ(index.Find("/a/y/z")->exclusiveB, 20 * BLKSZ);
+	EXPECT_EQ(index.Find("/b")->exclusiveB, 55 * BLKSZ);
+	EXPECT_EQ(index.Find("/b")->owners,
+			  (std::vector<std::string>{"lot3", "lot4"}));
+
+	// Every byte under the lot directories is credited exactly once
+	long long creditedB = 0;
+	for (const char *dir : {"/a", "/a/y", "/a/y/z", "/b"}) {
+		creditedB += index.Find(dir)->exclusiveB;
+	}
+	EXPECT_EQ(creditedB, (60 + 55) * BLKSZ);
+}
+
+TEST(LotDirIndexTest, ReportsOnlyLotsThatChanged) {
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(5);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "a", 0, 3, 4);
+	populatePurgeElement(elements[2], "b", 0, 0, 0);
+	populatePurgeElement(elements[3], "y", 1, 4, 5);
+	populatePurgeElement(elements[4], "z", 3, 0, 0);
+	std::vector<long long> blocks = {100, 60, 40, 30, 20};
+	for (size_t i = 0; i < elements.size(); ++i) {
+		elements[i].m_usage.m_StBlocks = blocks[i];
+	}
+	purge_shot.m_dir_vec = elements;
+
+	std::map<std::string, XrdPfc::LotInfo> lots;
+	lots["lot1"].paths = {{"/a", true}};
+	lots["lot2"].paths = {{"/a/y", true}};
+	lots["lot3"].paths = {{"/b", true}, {"/c", true}};
+	lots["lot4"].paths = {{"/a/y/z", true}};
+	XrdPfc::LotDirIndex index(XrdPfc::DirTree(purge_shot), purge_shot, lots);
+
+	// The same snapshot again changes nothing
+	EXPECT_TRUE(index.Update(XrdPfc::DirTree(purge_shot), purge_shot).empty());
+
+	// New data in /a/y/z adds to the usage of every directory above it, but
+	// only lot4's directory has more bytes of its own
+	for (int i : {0, 1, 3, 4}) {
+		purge_shot.m_dir_vec[i].m_usage.m_StBlocks += 5;
+	}
+	auto changed = index.Update(XrdPfc::DirTree(purge_shot), purge_shot);
+	EXPECT_EQ(changed, (std::unordered_set<std::string>{"lot4"}));
+	EXPECT_EQ(index.Find("/a/y/z")->exclusiveB, 25 * BLKSZ);
+	EXPECT_EQ(index.Find("/a/y")->exclusiveB, 10 * BLKSZ);
+
+	// A directory that shows up, even in a new spot of the snapshot, is
+	// found, and the lot directory that moved over for it is still followed
+	std::vector<XrdPfc::DirPurgeElement> moved(6);
+	populatePurgeElement(moved[0], "", -1, 1, 4);
+	populatePurgeElement(moved[1], "c", 0, 0, 0);
+	populatePurgeElement(moved[2], "a", 0, 4, 5);
+	populatePurgeElement(moved[3], "b", 0, 0, 0);
+	populatePurgeElement(moved[4], "y", 2, 5, 6);
+	populatePurgeElement(moved[5], "z", 4, 0, 0);
+	std::vector<long long> movedBlocks = {112, 7, 65, 40, 35, 25};
+	for (size_t i = 0; i < moved.size(); ++i) {
+		moved[i].m_usage.m_StBlocks = movedBlocks[i];
+	}
+	purge_shot.m_dir_vec = moved;
+	changed = index.Update(XrdPfc::DirTree(purge_shot), purge_shot);
+	EXPECT_EQ(changed, (std::unordered_set<std::string>{"lot3"}));
+	EXPECT_EQ(index.Size(), 5);
+	EXPECT_EQ(index.Find("/c")->exclusiveB, 7 * BLKSZ);
+	EXPECT_EQ(index.Find("/a")->exclusiveB, 30 * BLKSZ);
+}
+
+TEST(DirTreeTest, ChecksPathsInPlace) {
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(4);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "a", 0, 3, 4);
+	populatePurgeElement(elements[2], "ba", 0, 0, 0);
+	populatePurgeElement(elements[3], "y", 1, 0, 0);
+	purge_shot.m_dir_vec = elements;
+	XrdPfc::DirTree tree(purge_shot);
+
+	EXPECT_TRUE(tree.IsAt(0, "/"));
+	EXPECT_TRUE(tree.IsAt(1, "/a"));
+	EXPECT_TRUE(tree.IsAt(1, "/a/"));
+	EXPECT_TRUE(tree.IsAt(3, "/a/y"));
+	EXPECT_TRUE(tree.IsAt(2, "/ba"));
+	EXPECT_FALSE(tree.IsAt(2, "/a"));
+	EXPECT_FALSE(tree.IsAt(1, "/ba"));
+	EXPECT_FALSE(tree.IsAt(3, "/y"));
+	EXPECT_FALSE(tree.IsAt(3, "/b/y"));
+	EXPECT_FALSE(tree.IsAt(1, "/"));
+	EXPECT_FALSE(tree.IsAt(-1, "/a"));
+	EXPECT_FALSE(tree.IsAt(4, "/a"));
+}
+
+TEST(NominalTierTest, TargetsExcessOverNominal) {
+	// Nothing to do below the nominal, and the max is left to the full purge
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(700, 800, 1000, 0), 0);
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(800, 800, 1000, 0), 0);
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(1000, 800, 1000, 0), 0);
+	// Without file usage limits there's no nominal tier
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(900, -1, 1000, 0), 0);
+
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(810, 800, 1000, 50), 10);
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(950, 800, 1000, 50), 50);
+	// A tenth of the distance between the nominal and max by default
+	EXPECT_EQ(XrdPfc::nominalTierTargetB(950, 800, 1000, 0), 20);
+
+	// Only the stages that take from lots past a limit count as light
+	using XrdPfc::PurgePolicy;
+	auto light = [](PurgePolicy policy) {
+		return XrdPfc::XrdPurgeLotMan::makePolicyStage(policy).light;
+	};
+	EXPECT_TRUE(light(PurgePolicy::PastDel));
+	EXPECT_TRUE(light(PurgePolicy::PastExp));
+	EXPECT_TRUE(light(PurgePolicy::PastOpp));
+	EXPECT_FALSE(light(PurgePolicy::PastDed));
+	EXPECT_FALSE(light(PurgePolicy::PastObj));
+	EXPECT_FALSE(light(PurgePolicy::SizeOrderedLRU));
+}
+
+TEST(CollapseNestedCandidatesTest, MergesDescendantsIntoAncestors) {
+	XrdPfc::DataFsPurgeshot purge_shot;
+	XrdPfc::DirPurgeElement rootElement, parentElement, subElement1,
+		subElement2, subElement3, otherElement;
+	populatePurgeElement(rootElement, "", -1, 1, 3);
+	populatePurgeElement(parentElement, "dir", 0, 3, 5);
+	populatePurgeElement(otherElement, "other", 0, 0, 0);
+	populatePurgeElement(subElement1, "subdir1", 1, 0, 0);
+	populatePurgeElement(subElement2, "subdir2", 1, 5, 6);
+	populatePurgeElement(subElement3, "subdir3", 4, 0, 0);
+	parentElement.m_usage.m_StBlocks = 1000;
+	otherElement.m_usage.m_StBlocks = 10;
+	subElement2.m_usage.m_StBlocks = 400;
+	subElement3.m_usage.m_StBlocks = 100;
+
+	purge_shot.m_dir_vec = {rootElement, parentElement, otherElement,
+							subElement1, subElement2, subElement3};
+
+	XrdPfc::DirTree tree(purge_shot);
+
+	std::map<std::string, std::unique_ptr<XrdPfc::PurgeDirCandidateStats>>
+		candidates;
+	candidates["/dir"] =
+		std::make_unique<XrdPfc::PurgeDirCandidateStats>(100 * BLKSZ, 0);
+	candidates["/dir/subdir2/"] =
+		std::make_unique<XrdPfc::PurgeDirCandidateStats>(200 * BLKSZ, 0);
+	candidates["/dir/subdir2/subdir3"] =
+		std::make_unique<XrdPfc::PurgeDirCandidateStats>(50 * BLKSZ, 0);
+	// Asks for more than it has, so it should be capped at its own usage
+	candidates["/other"] =
+		std::make_unique<XrdPfc::PurgeDirCandidateStats>(20 * BLKSZ, 0);
+	// Unknown to the purge shot, so it's passed through as-is
+	candidates["/unknown"] =
+		std::make_unique<XrdPfc::PurgeDirCandidateStats>(7, 0);
+
+	std::vector<XrdPfc::PurgeCandidate> result =
+		XrdPfc::collapseNestedCandidates(tree, purge_shot, candidates);
+	ASSERT_EQ(result.size(), 3);
+	EXPECT_EQ(result[0].path, "/dir");
+	EXPECT_EQ(result[0].bytesToRecover, 350 * BLKSZ);
+	EXPECT_EQ(result[1].path, "/other");
+	EXPECT_EQ(result[1].bytesToRecover, 10 * BLKSZ);
+	EXPECT_EQ(result[2].path, "/unknown");
+	EXPECT_EQ(result[2].bytesToRecover, 7);
+}
+
+TEST(UsageUpdatePipelineTest, SendsInOrderAndStopsOnFailure) {
+	std::vector<std::string> sent;
+	XrdPfc::UsageUpdatePipeline pipeline(
+		[&](const std::string &update, size_t numDirs) {
+			sent.push_back(update + ":" + std::to_string(numDirs));
+			return true;
+		});
+	for (int i = 0; i < 5; ++i) {
+		ASSERT_TRUE(pipeline.Push("batch" + std::to_string(i), i + 1));
+	}
+	ASSERT_TRUE(pipeline.Finish());
+	EXPECT_EQ(pipeline.NumBatches(), 5);
+	EXPECT_EQ(sent, (std::vector<std::string>{"batch0:1", "batch1:2",
+											  "batch2:3", "batch3:4",
+											  "batch4:5"}));
+
+	// Nothing is sent after a batch fails
+	int attempts = 0;
+	XrdPfc::UsageUpdatePipeline failing(
+		[&](const std::string &, size_t) { return ++attempts < 2; });
+	bool accepted = true;
+	for (int i = 0; i < 10 && accepted; ++i) {
+		accepted = failing.Push("batch", 1);
+	}
+	EXPECT_FALSE(failing.Finish());
+	EXPECT_EQ(attempts, 2);
+}
+
+TEST(PurgeEfficiencyTrackerTest, LearnsFromFreedBytes) {
+	XrdPfc::PurgeEfficiencyTracker tracker;
+	// Without any history, requests pass through unchanged
+	EXPECT_EQ(tracker.AdjustRequest("/lot1/a", "lot1", 100, 1000), 100);
+
+	// The cache only managed to free half of what we asked for in /lot1/a, and
+	// everything we asked for in /lot1/b
+	tracker.RecordRequest("/lot1/a", "lot1", 100, 1000);
+	tracker.RecordRequest("/lot1/b", "lot1", 300, 1000);
+	std::map<std::string, long long> usageNow = {{"/lot1/a", 950},
+												 {"/lot1/b", 700}};
+	tracker.Reconcile(
+		[&usageNow](const std::string &dir) { return usageNow.at(dir); });
+	EXPECT_TRUE(tracker.GetPendingRequests().empty());
+
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/a", "lot1"), 0.5);
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/b", "lot1"), 1.0);
+	// Unseen dirs in the lot fall back to the lot's overall efficiency
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/c", "lot1"), 350.0 / 400.0);
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot2", "lot2"), 1.0);
+
+	// So we over-request from /lot1/a, but never more than it holds
+	EXPECT_EQ(tracker.AdjustRequest("/lot1/a", "lot1", 100, 1000), 200);
+	EXPECT_EQ(tracker.AdjustRequest("/lot1/a", "lot1", 100, 150), 150);
+
+	// A directory that vanished was cleared completely
+	tracker.RecordRequest("/lot1/b", "lot1", 1000, 700);
+	tracker.Reconcile([](const std::string &) { return -1ll; });
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/b", "lot1"), 0.85);
+
+	// One that grew was written to faster than it was purged, which says
+	// nothing about the cache, so the estimates stay as they were
+	const double lotEfficiency = tracker.GetEfficiency("/lot1/c", "lot1");
+	tracker.RecordRequest("/lot1/a", "lot1", 100, 1000);
+	tracker.Reconcile([](const std::string &) { return 1200ll; });
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/a", "lot1"), 0.5);
+	EXPECT_DOUBLE_EQ(tracker.GetEfficiency("/lot1/c", "lot1"), lotEfficiency);
+}
+
+TEST(reconstructPathsAndBuildJson, ParallelMatchesSerial) {
+	// Build a purge shot with a few uneven subtrees, one of which is big
+	// enough to get split across several tasks
+	XrdPfc::DataFsPurgeshot purge_shot;
+	XrdPfc::DirPurgeElement rootElement;
+	populatePurgeElement(rootElement, "", -1, 1, 4);
+	purge_shot.m_dir_vec.push_back(rootElement);
+	std::vector<std::string> names = {"big", "medium", "small"};
+	for (const auto &name : names) {
+		XrdPfc::DirPurgeElement element;
+		populatePurgeElement(element, name.c_str(), 0, 0, 0);
+		purge_shot.m_dir_vec.push_back(element);
+	}
+	std::vector<std::pair<int, int>> fanout = {{1, 40}, {2, 8}};
+	for (const auto &[parent, count] : fanout) {
+		for (int i = 0; i < count; ++i) {
+			XrdPfc::DirPurgeElement element;
+			std::string name = "sub" + std::to_string(i);
+			populatePurgeElement(element, name.c_str(), parent, 0, 0);
+			element.m_usage.m_StBlocks = 1000 + i;
+			purge_shot.m_dir_vec.push_back(element);
+		}
+	}
+	// Give some of the big subtree's directories children of their own
+	for (int i = 0; i < 10; ++i) {
+		XrdPfc::DirPurgeElement element;
+		populatePurgeElement(element, "leaf", 4 + i, 0, 0);
+		element.m_usage.m_StBlocks = 7;
+		purge_shot.m_dir_vec.push_back(element);
+	}
+
+	XrdPfc::DirTree tree(purge_shot);
+	json serial = XrdPfc::reconstructPathsAndBuildJson(tree, purge_shot, 1);
+	json parallel = XrdPfc::reconstructPathsAndBuildJson(tree, purge_shot, 4);
+	EXPECT_EQ(serial.size(), 3);
+	EXPECT_EQ(serial[0]["subdirs"].size(), 40);
+	EXPECT_EQ(serial, parallel);
+}
+
+TEST(SerializeDirTreesTest, MatchesDirTreeToJson) {
+	// Same shape as above, plus names that need escaping and sizes that
+	// aren't whole or are zero
+	XrdPfc::DataFsPurgeshot purge_shot;
+	XrdPfc::DirPurgeElement rootElement;
+	populatePurgeElement(rootElement, "", -1, 1, 4);
+	purge_shot.m_dir_vec.push_back(rootElement);
+	std::vector<std::string> names = {"big", "quote\"back\\slash",
+									  "tab\tnew\nline\x01"};
+	for (const auto &name : names) {
+		XrdPfc::DirPurgeElement element;
+		populatePurgeElement(element, name.c_str(), 0, 0, 0);
+		purge_shot.m_dir_vec.push_back(element);
+	}
+	std::vector<std::pair<int, int>> fanout = {{1, 40}, {2, 8}};
+	for (const auto &[parent, count] : fanout) {
+		for (int i = 0; i < count; ++i) {
+			XrdPfc::DirPurgeElement element;
+			std::string name = "sub" + std::to_string(i);
+			populatePurgeElement(element, name.c_str(), parent, 0, 0);
+			element.m_usage.m_StBlocks = i * 977;
+			purge_shot.m_dir_vec.push_back(element);
+		}
+	}
+	for (int i = 0; i < 10; ++i) {
+		XrdPfc::DirPurgeElement element;
+		populatePurgeElement(element, "leaf", 4 + i, 0, 0);
+		element.m_usage.m_StBlocks = 1953125000;
+		purge_shot.m_dir_vec.push_back(element);
+	}
+
+	XrdPfc::DirTree tree(purge_shot);
+	EXPECT_EQ(tree.SubtreeSize(0), purge_shot.m_dir_vec.size());
+	EXPECT_EQ(tree.SubtreeSize(1), 51);
+	auto dirBlocks = XrdPfc::dirBlockCounts(purge_shot);
+	std::vector<int> dirs = {1, 2, 3};
+	auto serial = XrdPfc::serializeDirTrees(tree, dirBlocks, dirs, 1);
+	auto parallel = XrdPfc::serializeDirTrees(tree, dirBlocks, dirs, 4);
+	ASSERT_EQ(serial.size(), dirs.size());
+	EXPECT_EQ(serial, parallel);
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		json expected = XrdPfc::dirTreeToJson(tree, dirs[i], purge_shot);
+		EXPECT_EQ(json::parse(serial[i]), expected) << serial[i];
+		// Sizes stay floating point numbers even when they're whole
+		EXPECT_TRUE(json::parse(serial[i])["size_GB"].is_number_float());
+	}
+	EXPECT_EQ(json::parse(serial[0])["subdirs"][0]["subdirs"][0]["size_GB"],
+			  1000.0);
+}
+
 TEST(GetPolicyNameTest, ReturnsCorrectPolicyName) {
 	EXPECT_EQ(XrdPfc::getPolicyName(XrdPfc::PurgePolicy::PastDel),
 			  "LotsPastDel");
@@ -224,6 +851,10 @@ TEST(GetPolicyNameTest, ReturnsCorrectPolicyName) {
 			  "LotsPastOpp");
 	EXPECT_EQ(XrdPfc::getPolicyName(XrdPfc::PurgePolicy::PastDed),
 			  "LotsPastDed");
+	EXPECT_EQ(XrdPfc::getPolicyName(XrdPfc::PurgePolicy::PastObj),
+			  "LotsPastObj");
+	EXPECT_EQ(XrdPfc::getPolicyName(XrdPfc::PurgePolicy::SizeOrderedLRU),
+			  "SizeOrderedLRU");
 	EXPECT_EQ(XrdPfc::getPolicyName(XrdPfc::PurgePolicy::UnknownPolicy),
 			  "UnknownPolicy");
 }
@@ -240,12 +871,225 @@ TEST(GetPolicyFromConfigNameTest, ReturnsCorrectPolicyEnum) {
 			  XrdPfc::PurgePolicy::PastOpp);
 	EXPECT_EQ(XrdPfc::getPolicyFromConfigName("ded"),
 			  XrdPfc::PurgePolicy::PastDed);
+	EXPECT_EQ(XrdPfc::getPolicyFromConfigName("obj"),
+			  XrdPfc::PurgePolicy::PastObj);
+	EXPECT_EQ(XrdPfc::getPolicyFromConfigName("lru"),
+			  XrdPfc::PurgePolicy::SizeOrderedLRU);
 	EXPECT_EQ(XrdPfc::getPolicyFromConfigName("foobar"),
 			  XrdPfc::PurgePolicy::UnknownPolicy);
 	EXPECT_EQ(XrdPfc::getPolicyFromConfigName(""),
 			  XrdPfc::PurgePolicy::UnknownPolicy);
 }
 
+TEST(ParseBoolOptionTest, HandlesValidAndInvalidValues) {
+	bool result = false;
+	EXPECT_TRUE(XrdPfc::parseBoolOption("on", result));
+	EXPECT_TRUE(result);
+	EXPECT_TRUE(XrdPfc::parseBoolOption("0", result));
+	EXPECT_FALSE(result);
+	EXPECT_FALSE(XrdPfc::parseBoolOption("maybe", result));
+}
+
+TEST(ParseDurationOptionTest, HandlesUnits) {
+	std::chrono::milliseconds result;
+	EXPECT_TRUE(XrdPfc::parseDurationOption("250ms", result));
+	EXPECT_EQ(result.count(), 250);
+	EXPECT_TRUE(XrdPfc::parseDurationOption("30", result));
+	EXPECT_EQ(result.count(), 30000);
+	EXPECT_TRUE(XrdPfc::parseDurationOption("2m", result));
+	EXPECT_EQ(result.count(), 120000);
+	EXPECT_TRUE(XrdPfc::parseDurationOption("1h", result));
+	EXPECT_EQ(result.count(), 3600000);
+	EXPECT_TRUE(XrdPfc::parseDurationOption("7d", result));
+	EXPECT_EQ(result, std::chrono::hours(168));
+	EXPECT_FALSE(XrdPfc::parseDurationOption("10w", result));
+	EXPECT_FALSE(XrdPfc::parseDurationOption("-5s", result));
+	EXPECT_FALSE(XrdPfc::parseDurationOption("soon", result));
+}
+
+TEST(ParseSizeOptionTest, HandlesUnits) {
+	long long result;
+	EXPECT_TRUE(XrdPfc::parseSizeOption("4096", result));
+	EXPECT_EQ(result, 4096);
+	EXPECT_TRUE(XrdPfc::parseSizeOption("2k", result));
+	EXPECT_EQ(result, 2048);
+	EXPECT_TRUE(XrdPfc::parseSizeOption("50G", result));
+	EXPECT_EQ(result, 50ll << 30);
+	EXPECT_TRUE(XrdPfc::parseSizeOption("1t", result));
+	EXPECT_EQ(result, 1ll << 40);
+	EXPECT_FALSE(XrdPfc::parseSizeOption("10x", result));
+	EXPECT_FALSE(XrdPfc::parseSizeOption("10gb", result));
+	EXPECT_FALSE(XrdPfc::parseSizeOption("", result));
+}
+
+TEST(UsageTrendTest, EstimatesFillRate) {
+	XrdPfc::UsageTrend trend{4};
+	// Not enough samples to say anything yet
+	trend.AddSample(1000, 100);
+	EXPECT_EQ(trend.GetFillRateBps(), 0.0);
+
+	// Steady growth of 10 bytes/second
+	trend.AddSample(1010, 200);
+	trend.AddSample(1020, 300);
+	EXPECT_DOUBLE_EQ(trend.GetFillRateBps(), 10.0);
+	EXPECT_EQ(trend.ProjectUsageB(60), 900);
+
+	// Only the most recent samples are kept
+	trend.AddSample(1030, 400);
+	trend.AddSample(1040, 500);
+	EXPECT_EQ(trend.NumSamples(), 4);
+}
+
+TEST(UsageTrendTest, PurgesDontLookLikeNegativeGrowth) {
+	XrdPfc::UsageTrend trend;
+	trend.AddSample(1000, 1000);
+	trend.AddSample(1010, 1100);
+	// Clear 500 bytes, then keep growing at the same rate
+	trend.RecordPurge(500);
+	trend.AddSample(1020, 700);
+	EXPECT_DOUBLE_EQ(trend.GetFillRateBps(), 10.0);
+	EXPECT_EQ(trend.ProjectUsageB(10), 800);
+}
+
+TEST(UsageTrendTest, CreditsWhatWasActuallyPurged) {
+	XrdPfc::UsageTrend trend;
+	trend.AddSample(1000, 1000);
+	trend.AddSample(1010, 1100);
+	// Two directories were asked for some of their bytes. One gave up 300,
+	// the other was written to faster than it was purged.
+	trend.RecordPurgeRequest("/a", 400);
+	trend.RecordPurgeRequest("/b", 200);
+	EXPECT_EQ(trend.ReconcilePurges([](const std::string &dir) {
+		return dir == "/a" ? 100ll : 250ll;
+	}),
+			  300);
+	EXPECT_TRUE(trend.GetPendingPurges().empty());
+	trend.AddSample(1020, 900);
+	EXPECT_DOUBLE_EQ(trend.GetFillRateBps(), 10.0);
+
+	// A directory that's gone gave up everything
+	EXPECT_EQ(XrdPfc::purgedBytes(400, -1), 400);
+	EXPECT_EQ(XrdPfc::purgedBytes(400, 500), 0);
+}
+
+TEST(ByteAccountingTest, ConvertsExactly) {
+	// Truncating 1.001 * GB2B would give 1000999999
+	EXPECT_EQ(XrdPfc::gbToBytes(1.001), 1001000000);
+	EXPECT_EQ(XrdPfc::gbToBytes(0.017), 17000000);
+	EXPECT_EQ(XrdPfc::gbToBytes(3333.1), 3333100000000ll);
+	EXPECT_EQ(XrdPfc::gbToBytes(XrdPfc::bytesToGB(123456789012345ll)),
+			  123456789012345ll);
+
+	EXPECT_EQ(XrdPfc::scaleBytes(1000, 1, 3), 333);
+	EXPECT_EQ(XrdPfc::scaleBytes(1000, 0, 3), 0);
+	EXPECT_EQ(XrdPfc::scaleBytes(1000, 3, 0), 0);
+	// Far past where bytes * numerator would overflow, or a double would
+	// lose the low bytes
+	EXPECT_EQ(XrdPfc::scaleBytes(9000000000000000001ll, 2, 3),
+			  6000000000000000000ll);
+	EXPECT_EQ(XrdPfc::scaleBytes(4611686018427387905ll, 999999999, 1000000000),
+			  4611686013815701886ll);
+}
+
+TEST(PurgeLogTest, SkipsAndSummarizes) {
+	XrdPfc::LogLevel level;
+	EXPECT_TRUE(XrdPfc::parseLogLevel("debug", level));
+	EXPECT_EQ(level, XrdPfc::LogLevel::Debug);
+	EXPECT_FALSE(XrdPfc::parseLogLevel("verbose", level));
+
+	XrdPfc::PurgeLog purgeLog;
+	purgeLog.SetLevel(XrdPfc::LogLevel::Warning);
+	purgeLog.Log(XrdPfc::LogLevel::Warning, "test", "Kept ", 42, " of ", 7.5);
+	EXPECT_EQ(purgeLog.Last(), "Kept 42 of 7.5");
+	// Messages above the configured level aren't formatted at all
+	EXPECT_FALSE(purgeLog.Enabled(XrdPfc::LogLevel::Info));
+	purgeLog.Log(XrdPfc::LogLevel::Info, "test", "Dropped");
+	EXPECT_EQ(purgeLog.Last(), "Kept 42 of 7.5");
+
+	purgeLog.SetLevel(XrdPfc::LogLevel::Debug);
+	const char *few[] = {"lot1", "lot2", nullptr};
+	purgeLog.Log(XrdPfc::LogLevel::Debug, "test", "Lots: ",
+				 XrdPfc::LogList{const_cast<char **>(few)}, " for ",
+				 XrdPfc::PurgePolicy::PastDel);
+	EXPECT_EQ(purgeLog.Last(), "Lots: lot1, lot2 for LotsPastDel");
+
+	std::vector<std::string> names;
+	for (int i = 0; i < 1000; ++i) {
+		names.push_back("lot" + std::to_string(i));
+	}
+	std::vector<char *> many;
+	for (auto &name : names) {
+		many.push_back(name.data());
+	}
+	many.push_back(nullptr);
+	purgeLog.Log(XrdPfc::LogLevel::Debug, "test",
+				 XrdPfc::LogList{many.data()});
+	EXPECT_EQ(purgeLog.Last(), "lot0, lot1, lot2, lot3, lot4, lot5, lot6, "
+							   "lot7, ... (1000 in total)");
+
+	// Overly long messages are cut short instead of growing the buffer
+	std::string longText(XrdPfc::PurgeLog::kBufferSize * 2, 'x');
+	purgeLog.Log(XrdPfc::LogLevel::Error, "test", longText);
+	EXPECT_EQ(purgeLog.Last().size(), XrdPfc::PurgeLog::kBufferSize);
+	EXPECT_EQ(purgeLog.Last().substr(purgeLog.Last().size() - 3), "...");
+}
+
+TEST(PluginStateTest, Fingerprint) {
+	// Persisted fingerprints must not change between builds
+	EXPECT_EQ(XrdPfc::fingerprint(""), 0xcbf29ce484222325ull);
+	EXPECT_EQ(XrdPfc::fingerprint("a"), 0xaf63dc4c8601ec8cull);
+	EXPECT_NE(XrdPfc::fingerprint("ab"), XrdPfc::fingerprint("ba"));
+}
+
+TEST(PluginStateTest, RoundTrip) {
+	XrdPfc::UsageTrend trend;
+	trend.AddSample(1000, 1000);
+	trend.AddSample(1010, 1100);
+	trend.RecordPurge(500);
+	trend.RecordPurgeRequest("/lot1/c", 2000);
+	XrdPfc::PurgeEfficiencyTracker tracker;
+	tracker.RecordRequest("/lot1/a", "lot1", 100, 1000);
+	tracker.Reconcile([](const std::string &) { return 950; });
+	tracker.RecordRequest("/lot1/b", "lot1", 300, 1000);
+
+	XrdPfc::StateWriter writer;
+	trend.Save(writer);
+	tracker.Save(writer);
+	writer.PutString("done");
+
+	XrdPfc::StateReader reader(writer.Data());
+	XrdPfc::UsageTrend loadedTrend;
+	XrdPfc::PurgeEfficiencyTracker loadedTracker;
+	ASSERT_TRUE(loadedTrend.Load(reader));
+	ASSERT_TRUE(loadedTracker.Load(reader));
+	std::string tail;
+	ASSERT_TRUE(reader.GetString(tail));
+	EXPECT_EQ(tail, "done");
+	EXPECT_TRUE(reader.Done());
+
+	// The restored trend picks up exactly where the original left off
+	trend.AddSample(1020, 700);
+	loadedTrend.AddSample(1020, 700);
+	EXPECT_DOUBLE_EQ(loadedTrend.GetFillRateBps(), trend.GetFillRateBps());
+	EXPECT_EQ(loadedTrend.ProjectUsageB(10), trend.ProjectUsageB(10));
+	EXPECT_EQ(loadedTrend.GetPendingPurges(), trend.GetPendingPurges());
+
+	EXPECT_DOUBLE_EQ(loadedTracker.GetEfficiency("/lot1/a", "lot1"), 0.5);
+	EXPECT_DOUBLE_EQ(loadedTracker.GetEfficiency("/lot1/z", "lot1"), 0.5);
+	ASSERT_EQ(loadedTracker.GetPendingRequests().size(), 1);
+	EXPECT_EQ(loadedTracker.GetPendingRequests().at("/lot1/b").requestedB,
+			  300);
+
+	// Truncated data is rejected rather than half-loaded
+	std::string truncated = writer.Data().substr(0, writer.Data().size() / 2);
+	XrdPfc::StateReader shortReader(truncated);
+	XrdPfc::UsageTrend shortTrend;
+	XrdPfc::PurgeEfficiencyTracker shortTracker;
+	EXPECT_FALSE(shortTrend.Load(shortReader) &&
+				 shortTracker.Load(shortReader));
+	EXPECT_EQ(shortTracker.GetPendingRequests().size(), 0);
+}
+
 TEST_F(LMSetupTeardown, GetTotalUsageBTest) {
 	// Create a few lots
 	// Current time in milliseconds since epoch
@@ -341,14 +1185,26 @@ TEST_F(LMSetupTeardown, GetTotalUsageBTest) {
 	ASSERT_TRUE(rv == 0) << err;
 
 	long long totalUsage;
-	// shouldn't double count usage of lot3.
-	long long expectedUsage = (32.1 + 12.3 + 3434.0 + 3333.1) * GB2B;
+	// shouldn't double count usage of lot3. Each root lot's usage is rounded
+	// to the byte on its own.
+	long long expectedUsage =
+		32100000000ll + 12300000000ll + 3434000000000ll + 3333100000000ll;
 	XrdPurgeLotManTest testPurgePin{};
 	totalUsage = testPurgePin.testGetTotalUsageB();
 
 	ASSERT_TRUE(totalUsage == expectedUsage)
 		<< "Expected usage: " << expectedUsage
 		<< " Actual usage: " << totalUsage;
+
+	// Every root lot's usage was fetched along the way, and asking again
+	// doesn't add anything
+	const auto &lotUsage = testPurgePin.testFetchLotUsage({"lot1", "lot2"});
+	EXPECT_EQ(lotUsage.size(), 5);
+	auto lot1Usage = lotUsage.find("lot1");
+	ASSERT_NE(lot1Usage, lotUsage.end());
+	EXPECT_EQ(lot1Usage->second.totalB, 12300000000ll);
+	EXPECT_EQ(lot1Usage->second.dedicatedB, 17000000);
+	EXPECT_EQ(lot1Usage->second.opportunisticB, 10000000);
 }
 
 TEST_F(LMSetupTeardown, ValidPurgePinConfigTest) {
@@ -377,6 +1233,689 @@ TEST_F(LMSetupTeardown, ValidPurgePinConfigTest) {
 	lotmanConf = testPurgePin.testGetLotmanConf();
 	EXPECT_EQ(lotHome, lotmanConf.GetLotHome());
 	EXPECT_EQ(expectedPolicies, lotmanConf.GetPolicy());
+	EXPECT_FALSE(lotmanConf.GetPredictive());
+	EXPECT_FALSE(lotmanConf.GetFeedback());
+
+	// Options can be mixed in with the policies
+	configParams = lotHome + " del predictive=on ded deadline=90s";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	expectedPolicies = {PurgePolicy::PastDel, PurgePolicy::PastDed};
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_EQ(expectedPolicies, lotmanConf.GetPolicy());
+	EXPECT_TRUE(lotmanConf.GetPredictive());
+	EXPECT_EQ(lotmanConf.GetDeadline(), std::chrono::seconds(90));
+
+	configParams = lotHome + " feedback=on";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_TRUE(lotmanConf.GetFeedback());
+
+	configParams = lotHome + " incremental=on updatebatch=64m";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_TRUE(lotmanConf.GetIncremental());
+	EXPECT_EQ(lotmanConf.GetUpdateBatchB(), 64ll << 20);
+
+	configParams = lotHome + " graduated=on nominalbudget=2g";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_TRUE(lotmanConf.GetGraduated());
+	EXPECT_EQ(lotmanConf.GetNominalBudgetB(), 2ll << 30);
+
+	// Stages can carry their own parameters, and the same policy may appear
+	// more than once as long as its parameters differ
+	configParams = lotHome + " del opp:budget=10g lru:minage=1h,budget=5g " +
+				   "obj opp ded";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	expectedPolicies = {PurgePolicy::PastDel, PurgePolicy::PastOpp,
+						PurgePolicy::SizeOrderedLRU, PurgePolicy::PastObj,
+						PurgePolicy::PastOpp, PurgePolicy::PastDed};
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_EQ(expectedPolicies, lotmanConf.GetPolicy());
+	const auto &pipeline = lotmanConf.GetPipeline();
+	ASSERT_EQ(pipeline.size(), 6);
+	EXPECT_EQ(pipeline[0].params.budgetB, 0);
+	EXPECT_EQ(pipeline[1].params.budgetB, 10ll << 30);
+	EXPECT_EQ(pipeline[2].params.budgetB, 5ll << 30);
+	EXPECT_EQ(pipeline[2].params.minAge, std::chrono::hours(1));
+	for (const auto &stage : pipeline) {
+		EXPECT_NE(stage.run, nullptr);
+	}
+
+	// Top-level directories can be given lot homes of their own
+	std::string shardHome = lotHome + "/atlas-lots";
+	std::filesystem::create_directory(shardHome);
+	configParams = lotHome + " del shard=/atlas:" + shardHome + " ded";
+	rv = testPurgePin.ConfigPurgePin(configParams.c_str());
+	ASSERT_TRUE(rv);
+	expectedPolicies = {PurgePolicy::PastDel, PurgePolicy::PastDed};
+	lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_EQ(expectedPolicies, lotmanConf.GetPolicy());
+	ASSERT_EQ(lotmanConf.GetShards().size(), 1);
+	EXPECT_EQ(lotmanConf.GetShards()[0].first, "/atlas");
+	EXPECT_EQ(lotmanConf.GetShards()[0].second, shardHome);
+	EXPECT_EQ(testPurgePin.testFindShard("atlas"), 1);
+	EXPECT_EQ(testPurgePin.testFindShard("cms"), 0);
+}
+
+TEST_F(LMSetupTeardown, WarmStartTest) {
+	using namespace XrdPfc;
+
+	auto currentTimeMSEpoch =
+		std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::system_clock::now().time_since_epoch())
+			.count();
+	std::string lotStr =
+		createLotJSON("lot1", "owner1", "/lot1", false, 0.017, 0.01,
+					  currentTimeMSEpoch, currentTimeMSEpoch + 30000,
+					  currentTimeMSEpoch + 60000)
+			.dump();
+	char *err;
+	ASSERT_EQ(lotman_add_lot(lotStr.c_str(), &err), 0) << err;
+
+	// Without warm start, nothing is loaded until the first purge cycle
+	std::string lotHome = LMSetupTeardown::tmp_dir;
+	XrdPurgeLotManTest testPurgePin{};
+	ASSERT_TRUE(testPurgePin.ConfigPurgePin(lotHome.c_str()));
+	EXPECT_TRUE(testPurgePin.testGetLotCache().empty());
+
+	std::string configParams = lotHome + " warmstart=on lotcachettl=10m";
+	ASSERT_TRUE(testPurgePin.ConfigPurgePin(configParams.c_str()));
+	auto lotmanConf = testPurgePin.testGetLotmanConf();
+	EXPECT_TRUE(lotmanConf.GetWarmStart());
+	EXPECT_EQ(lotmanConf.GetLotCacheTTL(), std::chrono::minutes(10));
+
+	const auto &lotCache = testPurgePin.testGetLotCache();
+	auto it = lotCache.find("lot1");
+	ASSERT_NE(it, lotCache.end());
+	ASSERT_EQ(it->second.paths.size(), 1);
+	EXPECT_EQ(it->second.paths[0].first, "/lot1");
+	EXPECT_FALSE(it->second.paths[0].second);
+	EXPECT_EQ(it->second.dedicatedB, 17000000);
+	EXPECT_EQ(it->second.opportunisticB, 10000000);
+	EXPECT_EQ(it->second.maxObjects, 100);
+}
+
+TEST_F(LMSetupTeardown, PersistedStateTest) {
+	using namespace XrdPfc;
+
+	// A lot home LotMan hasn't set up a database in yet
+	const std::string lotHome = LMSetupTeardown::tmp_dir + "/persist";
+	std::filesystem::create_directory(lotHome);
+
+	std::string configParams = lotHome + " persist=on";
+	{
+		XrdPurgeLotManTest testPurgePin{};
+		ASSERT_TRUE(testPurgePin.ConfigPurgePin(configParams.c_str()));
+		testPurgePin.testGetUsageTrend().AddSample(1000, 100);
+		testPurgePin.testGetUsageTrend().AddSample(1010, 200);
+		ASSERT_TRUE(testPurgePin.testSaveState());
+	}
+	EXPECT_TRUE(std::filesystem::exists(lotHome + "/xrootd-lotman.state"));
+
+	// A fresh instance, as after a restart, picks the trend back up
+	XrdPurgeLotManTest restarted{};
+	ASSERT_TRUE(restarted.ConfigPurgePin(configParams.c_str()));
+	EXPECT_EQ(restarted.testGetUsageTrend().NumSamples(), 2);
+	EXPECT_DOUBLE_EQ(restarted.testGetUsageTrend().GetFillRateBps(), 10.0);
+
+	// Without persist, nothing is restored
+	XrdPurgeLotManTest fresh{};
+	ASSERT_TRUE(fresh.ConfigPurgePin(lotHome.c_str()));
+	EXPECT_EQ(fresh.testGetUsageTrend().NumSamples(), 0);
+}
+
+TEST_F(LMSetupTeardown, WhatIfTest) {
+	XrdPurgeLotManTest testPurgePin{};
+	ASSERT_TRUE(testPurgePin.ConfigPurgePin(LMSetupTeardown::tmp_dir.c_str()));
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(2);
+	populatePurgeElement(elements[0], "", -1, 1, 2);
+	populatePurgeElement(elements[1], "whatif", 0, 0, 0);
+	elements[0].m_usage.m_StBlocks = 100;
+	elements[1].m_usage.m_StBlocks = 100;
+	purge_shot.m_dir_vec = elements;
+
+	// The request sits directly in the lot home, which exists before LotMan
+	// has created anything there
+	const std::string requestPath = testPurgePin.testGetWhatIfPath();
+	const std::string resultPath = requestPath + ".result";
+	EXPECT_EQ(std::filesystem::path(requestPath).parent_path(),
+			  LMSetupTeardown::tmp_dir);
+	auto evaluate = [&](const std::string &request) {
+		std::ofstream(requestPath) << request;
+		testPurgePin.testRunWhatIf(purge_shot);
+		std::ifstream in(resultPath);
+		return json::parse(in);
+	};
+
+	// A request that can't be read is answered with an error, and removed
+	json result = evaluate("not json");
+	EXPECT_FALSE(std::filesystem::exists(requestPath));
+	EXPECT_TRUE(result.contains("error"));
+
+	// With limits far above the usage, there's nothing to purge
+	result = evaluate(
+		R"({"hwm": "1024t", "lwm": "512t", "policies": "del opp:budget=1g"})");
+	EXPECT_FALSE(std::filesystem::exists(requestPath));
+	ASSERT_FALSE(result.contains("error")) << result.dump();
+	EXPECT_EQ(result["hwm"], 1ll << 50);
+	EXPECT_EQ(result["lwm"], 1ll << 49);
+	EXPECT_EQ(result["policies"], json::array({"del", "opp"}));
+	EXPECT_EQ(result["bytes_to_recover"], 0);
+	EXPECT_EQ(result["bytes_found"], 0);
+	EXPECT_TRUE(result["candidates"].empty());
+
+	// Limits below the usage purge down to the lwm
+	result = evaluate(R"({"hwm": 1, "lwm": 1})");
+	ASSERT_FALSE(result.contains("error")) << result.dump();
+	const long long usage = result["usage"];
+	EXPECT_EQ(result["bytes_to_recover"], std::max(usage - 1, 0ll));
+	EXPECT_LE(result["bytes_found"].get<long long>(),
+			  result["bytes_to_recover"].get<long long>());
+}
+
+TEST_F(LMSetupTeardown, DeadlineTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+
+	// Two top-level directories that are left to the default lot
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(3);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "deadline1", 0, 0, 0);
+	populatePurgeElement(elements[2], "deadline2", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 2;
+	elements[2].m_usage.m_StBlocks = 2;
+	elements[0].m_usage.m_StBlocks = 4;
+	purge_shot.m_dir_vec = elements;
+
+	auto purgedDirs = [](XrdPurgeLotManTest &purgePin) {
+		std::vector<std::string> dirs;
+		for (const auto &dirInfo : purgePin.refDirInfos()) {
+			dirs.push_back(dirInfo.path);
+		}
+		return dirs;
+	};
+
+	// Without a deadline both stages get their say
+	XrdPurgeLotManCycleTest unlimited;
+	ASSERT_TRUE(unlimited.ConfigPurgePin(LMSetupTeardown::tmp_dir.c_str()));
+	unlimited.useSlowPipeline();
+	EXPECT_GT(unlimited.GetBytesToRecover(purge_shot), 0);
+	EXPECT_FALSE(unlimited.WasLastCycleTruncated());
+	EXPECT_EQ(purgedDirs(unlimited),
+			  std::vector<std::string>({"/deadline1/", "/deadline2/"}));
+
+	// Once the first stage uses up the deadline, the second is skipped but
+	// what the first one found is still handed to the cache
+	XrdPurgeLotManCycleTest limited;
+	ASSERT_TRUE(limited.ConfigPurgePin(
+		(LMSetupTeardown::tmp_dir + " deadline=50ms").c_str()));
+	limited.useSlowPipeline();
+	EXPECT_GT(limited.GetBytesToRecover(purge_shot), 0);
+	EXPECT_TRUE(limited.WasLastCycleTruncated());
+	EXPECT_EQ(purgedDirs(limited), std::vector<std::string>({"/deadline1/"}));
+}
+
+TEST_F(LMSetupTeardown, WhatIfLeavesCyclesAloneTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+	// One lot past its deletion time, and one that's only over its quotas
+	addLotIfMissing(createLotJSON("whatif_del", "owner1", "/whatif_del", true,
+								  0.0001, 0.0001, now - 2000, now - 1000,
+								  now - 1000));
+	addLotIfMissing(createLotJSON("whatif_ded", "owner1", "/whatif_ded", true,
+								  0.0001, 0.0001, now, now + 240000,
+								  now + 300000));
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(3);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "whatif_del", 0, 0, 0);
+	populatePurgeElement(elements[2], "whatif_ded", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 2048;
+	elements[2].m_usage.m_StBlocks = 2048;
+	elements[0].m_usage.m_StBlocks = 4096;
+	purge_shot.m_dir_vec = elements;
+
+	auto purgeList = [](XrdPurgeLotManTest &purgePin) {
+		std::vector<std::pair<std::string, long long>> dirs;
+		for (const auto &dirInfo : purgePin.refDirInfos()) {
+			dirs.emplace_back(dirInfo.path, dirInfo.nBytesToRecover);
+		}
+		return dirs;
+	};
+
+	// Two cycles in a row without a what-if in between
+	XrdPurgeLotManCycleTest plain;
+	ASSERT_TRUE(plain.ConfigPurgePin(LMSetupTeardown::tmp_dir.c_str()));
+	ASSERT_GT(plain.GetBytesToRecover(purge_shot), 0);
+	const long long plainBytes = plain.GetBytesToRecover(purge_shot);
+	const auto plainList = purgeList(plain);
+	const json plainState = plain.testCycleState();
+	ASSERT_FALSE(plainList.empty());
+
+	// A what-if with a pipeline that looks at every lot leaves what the
+	// real cycle cached as it was
+	XrdPurgeLotManCycleTest withWhatIf;
+	ASSERT_TRUE(withWhatIf.ConfigPurgePin(LMSetupTeardown::tmp_dir.c_str()));
+	ASSERT_GT(withWhatIf.GetBytesToRecover(purge_shot), 0);
+	const json cycleState = withWhatIf.testCycleState();
+	std::ofstream(withWhatIf.testGetWhatIfPath())
+		<< R"({"hwm": 1, "lwm": 1, "policies": "lru"})";
+	withWhatIf.testRunWhatIf(purge_shot);
+	std::ifstream in(withWhatIf.testGetWhatIfPath() + ".result");
+	json result = json::parse(in);
+	ASSERT_FALSE(result.contains("error")) << result.dump();
+	EXPECT_FALSE(result["candidates"].empty());
+	EXPECT_EQ(withWhatIf.testCycleState(), cycleState);
+
+	// A request dropped in during a cycle is answered right after it, without
+	// touching the cache's purge list or what the next cycle comes up with
+	std::ofstream(withWhatIf.testGetWhatIfPath())
+		<< R"({"hwm": 1, "lwm": 1, "policies": "lru"})";
+	EXPECT_EQ(withWhatIf.GetBytesToRecover(purge_shot), plainBytes);
+	EXPECT_FALSE(std::filesystem::exists(withWhatIf.testGetWhatIfPath()));
+	EXPECT_EQ(purgeList(withWhatIf), plainList);
+	EXPECT_EQ(withWhatIf.GetBytesToRecover(purge_shot), plainBytes);
+	EXPECT_EQ(purgeList(withWhatIf), plainList);
+	EXPECT_EQ(withWhatIf.testCycleState(), plainState);
+}
+
+TEST_F(LMSetupTeardown, UsageUpdateBatchTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+	// A lot whose usage comes from two top-level directories, with another
+	// lot's directory between them
+	json spanning = createLotJSON("spanning", "owner1", "/span_a", true, 1.0,
+								  1.0, now, now + 240000, now + 300000);
+	spanning["paths"].push_back({{"path", "/span_b"}, {"recursive", true}});
+	addLotIfMissing(spanning);
+	addLotIfMissing(createLotJSON("span_mid", "owner1", "/span_mid", true, 1.0,
+								  1.0, now, now + 240000, now + 300000));
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(4);
+	populatePurgeElement(elements[0], "", -1, 1, 4);
+	populatePurgeElement(elements[1], "span_a", 0, 0, 0);
+	populatePurgeElement(elements[2], "span_mid", 0, 0, 0);
+	populatePurgeElement(elements[3], "span_b", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 2048;
+	elements[2].m_usage.m_StBlocks = 1024;
+	elements[3].m_usage.m_StBlocks = 4096;
+	elements[0].m_usage.m_StBlocks = 2048 + 1024 + 4096;
+	purge_shot.m_dir_vec = elements;
+
+	auto lotManTotalB = [](const std::string &lot) {
+		XrdPurgeLotManTest reader;
+		const auto &usage = reader.testFetchLotUsage({lot});
+		auto it = usage.find(lot);
+		return it == usage.end() ? -1 : it->second.totalB;
+	};
+
+	// Batches of a single byte would put every top-level directory in one of
+	// its own, but both of spanning's go together
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(purgePin.ConfigPurgePin(
+		(LMSetupTeardown::tmp_dir + " updatebatch=1").c_str()));
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(lotManTotalB("spanning"), (2048 + 4096) * BLKSZ);
+	EXPECT_EQ(lotManTotalB("span_mid"), 1024 * BLKSZ);
+}
+
+TEST_F(LMSetupTeardown, PredictivePurgeTest) {
+	const std::string lotHome = createLotHome("predictive");
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("pred", "owner1", "/pred", true, 1.0, 1.0,
+								  now - 2000, now - 1000, now - 1000));
+
+	// A lot past its deletion time, and new data arriving elsewhere at 1 KiB
+	// a second
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(3);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "pred", 0, 0, 0);
+	populatePurgeElement(elements[2], "grow", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 20000;
+	elements[2].m_usage.m_StBlocks = 2000;
+	elements[0].m_usage.m_StBlocks = 22000;
+	purge_shot.m_dir_vec = elements;
+	const long long usageB = 22000 * BLKSZ;
+
+	auto purgeList = [](XrdPurgeLotManTest &purgePin) {
+		std::vector<std::pair<std::string, long long>> dirs;
+		for (const auto &dirInfo : purgePin.refDirInfos()) {
+			dirs.emplace_back(dirInfo.path, dirInfo.nBytesToRecover);
+		}
+		return dirs;
+	};
+
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(
+		purgePin.ConfigPurgePin((lotHome + " del predictive=on").c_str()));
+	purgePin.m_hwm = usageB + 51200;
+	purgePin.m_lwm = usageB / 2;
+	purgePin.testGetUsageTrend().AddSample(800, usageB - 204800);
+	purgePin.testGetUsageTrend().AddSample(900, usageB - 102400);
+
+	// Still under the max, but another 100 seconds at this rate would take
+	// usage 51200 bytes over it
+	purgePin.m_now = 1000;
+	EXPECT_EQ(purgePin.GetBytesToRecover(purge_shot), 51200);
+	EXPECT_EQ(purgeList(purgePin),
+			  (std::vector<std::pair<std::string, long long>>{
+				  {"/pred/", 51200}}));
+
+	// The cache frees whole files, so 76800 bytes go from /pred, while /grow
+	// keeps growing at the same rate
+	elements[1].m_usage.m_StBlocks = 20000 - 150;
+	elements[2].m_usage.m_StBlocks = 2000 + 200;
+	elements[0].m_usage.m_StBlocks = 22050;
+	purge_shot.m_dir_vec = elements;
+
+	// Credited with what was really freed, the trend still sees 1 KiB a
+	// second, so usage is headed 128000 bytes past where it was, which is
+	// 76800 over the max
+	purgePin.m_now = 1100;
+	EXPECT_DOUBLE_EQ(purgePin.testGetUsageTrend().GetFillRateBps(), 1024.0);
+	EXPECT_EQ(purgePin.GetBytesToRecover(purge_shot), 76800);
+	EXPECT_DOUBLE_EQ(purgePin.testGetUsageTrend().GetFillRateBps(), 1024.0);
+	EXPECT_EQ(purgeList(purgePin),
+			  (std::vector<std::pair<std::string, long long>>{
+				  {"/pred/", 76800}}));
+}
+
+TEST_F(LMSetupTeardown, ShardedCycleTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	// /atlas is tracked in a lot home of its own, everything else in the
+	// main one. Both have a lot past its deletion time, and the main one
+	// also has a lot that's only past its expiration time.
+	const std::string atlasHome = createLotHome("sharded_atlas");
+	addLotIfMissing(createLotJSON("atlas_del", "owner1", "/atlas", true, 1.0,
+								  1.0, now - 2000, now - 1000, now - 1000));
+	const std::string lotHome = createLotHome("sharded");
+	addLotIfMissing(createLotJSON("cms_del", "owner1", "/cms", true, 1.0, 1.0,
+								  now - 2000, now - 1000, now - 1000));
+	addLotIfMissing(createLotJSON("cms_exp", "owner1", "/cms_exp", true, 1.0,
+								  1.0, now - 2000, now - 1000, now + 300000));
+
+	// /other isn't in any lot, so it counts towards the main default lot
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(5);
+	populatePurgeElement(elements[0], "", -1, 1, 5);
+	populatePurgeElement(elements[1], "atlas", 0, 0, 0);
+	populatePurgeElement(elements[2], "cms", 0, 0, 0);
+	populatePurgeElement(elements[3], "cms_exp", 0, 0, 0);
+	populatePurgeElement(elements[4], "other", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 1024;
+	elements[2].m_usage.m_StBlocks = 2048;
+	elements[3].m_usage.m_StBlocks = 1024;
+	elements[4].m_usage.m_StBlocks = 4096;
+	elements[0].m_usage.m_StBlocks = 8192;
+	purge_shot.m_dir_vec = elements;
+
+	// Enough for both lots past deletion, plus a little more
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(purgePin.ConfigPurgePin(
+		(lotHome + " del exp shard=/atlas:" + atlasHome).c_str()));
+	purgePin.m_lwm = (8192 - 2048 - 1024 - 256) * BLKSZ;
+	// Only comes out right if the usage of both shards is added up
+	EXPECT_EQ(purgePin.GetBytesToRecover(purge_shot), 3328 * BLKSZ);
+
+	// Each lot home only heard about its own top-level directories
+	auto lotManTotalB = [](const std::string &home, const std::string &lot) {
+		char *err;
+		EXPECT_EQ(lotman_set_context_str("lot_home", home.c_str(), &err), 0);
+		XrdPurgeLotManTest reader;
+		const auto &usage = reader.testFetchLotUsage({lot});
+		auto it = usage.find(lot);
+		return it == usage.end() ? -1 : it->second.totalB;
+	};
+	EXPECT_EQ(lotManTotalB(lotHome, "cms_del"), 2048 * BLKSZ);
+	EXPECT_EQ(lotManTotalB(lotHome, "cms_exp"), 1024 * BLKSZ);
+	EXPECT_EQ(lotManTotalB(lotHome, "default"), 4096 * BLKSZ);
+	EXPECT_EQ(lotManTotalB(atlasHome, "atlas_del"), 1024 * BLKSZ);
+	EXPECT_EQ(lotManTotalB(atlasHome, "default"), 0);
+
+	// The deletion stage runs in both shards before the expiration stage
+	// gets what's left, so /cms_exp only gives up the last 256 blocks
+	std::map<std::string, long long> purgeList;
+	for (const auto &dirInfo : purgePin.refDirInfos()) {
+		purgeList[dirInfo.path] = dirInfo.nBytesToRecover;
+	}
+	EXPECT_EQ(purgeList, (std::map<std::string, long long>{
+							 {"/atlas/", 1024 * BLKSZ},
+							 {"/cms/", 2048 * BLKSZ},
+							 {"/cms_exp/", 256 * BLKSZ}}));
+}
+
+TEST_F(LMSetupTeardown, LocalUsageMatchesLotManTest) {
+	const std::string lotHome = createLotHome("localusage");
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("local_lot", "owner1", "/local_a", true, 1.0,
+								  1.0, now, now + 240000, now + 300000));
+
+	// Nothing claims /unclaimed or anything below it
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(4);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "local_a", 0, 0, 0);
+	populatePurgeElement(elements[2], "unclaimed", 0, 3, 4);
+	populatePurgeElement(elements[3], "sub", 2, 0, 0);
+	elements[1].m_usage.m_StBlocks = 1024;
+	elements[2].m_usage.m_StBlocks = 2048;
+	elements[3].m_usage.m_StBlocks = 512;
+	elements[0].m_usage.m_StBlocks = 1024 + 2048;
+	purge_shot.m_dir_vec = elements;
+	const long long usageB = (1024 + 2048) * BLKSZ;
+
+	auto lotManTotalB = [](const std::string &lot) {
+		XrdPurgeLotManTest reader;
+		const auto &usage = reader.testFetchLotUsage({lot});
+		auto it = usage.find(lot);
+		return it == usage.end() ? -1 : it->second.totalB;
+	};
+
+	XrdPurgeLotManCycleTest fromLotMan;
+	ASSERT_TRUE(fromLotMan.ConfigPurgePin(lotHome.c_str()));
+	EXPECT_EQ(fromLotMan.GetBytesToRecover(purge_shot), usageB - 1);
+	EXPECT_EQ(lotManTotalB("default"), 2048 * BLKSZ);
+	EXPECT_EQ(lotManTotalB("local_lot"), 1024 * BLKSZ);
+
+	// Worked out by the plugin, the unclaimed data still counts
+	XrdPurgeLotManCycleTest local;
+	ASSERT_TRUE(local.ConfigPurgePin((lotHome + " localusage=on").c_str()));
+	EXPECT_EQ(local.GetBytesToRecover(purge_shot), usageB - 1);
+	const auto &localUsage = local.testGetLocalUsage();
+	ASSERT_TRUE(localUsage.count("default"));
+	ASSERT_TRUE(localUsage.count("local_lot"));
+	EXPECT_EQ(localUsage.at("default").totalB, lotManTotalB("default"));
+	EXPECT_EQ(localUsage.at("local_lot").totalB, lotManTotalB("local_lot"));
+}
+
+TEST_F(LMSetupTeardown, FeedbackIgnoresNewWritesTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(3);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "feedback_a", 0, 0, 0);
+	populatePurgeElement(elements[2], "feedback_b", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 1000;
+	elements[2].m_usage.m_StBlocks = 1000;
+	elements[0].m_usage.m_StBlocks = 2000;
+	purge_shot.m_dir_vec = elements;
+
+	auto purgeList = [](XrdPurgeLotManTest &purgePin) {
+		std::vector<std::pair<std::string, long long>> dirs;
+		for (const auto &dirInfo : purgePin.refDirInfos()) {
+			dirs.emplace_back(dirInfo.path, dirInfo.nBytesToRecover);
+		}
+		return dirs;
+	};
+	const std::vector<std::pair<std::string, long long>> expected = {
+		{"/feedback_a/", 51200}, {"/feedback_b/", 51200}};
+
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(purgePin.ConfigPurgePin(
+		(LMSetupTeardown::tmp_dir + " feedback=on").c_str()));
+	purgePin.useFixedPipeline({{"/feedback_a", 51200}, {"/feedback_b", 51200}});
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(purgeList(purgePin), expected);
+
+	// The cache frees all that was asked for from both directories, but
+	// /feedback_a takes in more new data than it lost before the next cycle
+	elements[1].m_usage.m_StBlocks = 1000 - 100 + 300;
+	elements[2].m_usage.m_StBlocks = 1000 - 100;
+	elements[0].m_usage.m_StBlocks = 2100;
+	purge_shot.m_dir_vec = elements;
+
+	// Neither directory is taken to have underdelivered, so nothing is
+	// over-requested
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(purgeList(purgePin), expected);
+}
+
+TEST_F(LMSetupTeardown, IncrementalUpdateTest) {
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	addLotIfMissing(createLotJSON("default", "owner2", "/default", true, 0.032,
+								  0.01, now, now + 240000, now + 300000));
+	json incr = createLotJSON("incr", "owner1", "/incr_a", true, 1.0, 1.0, now,
+							  now + 240000, now + 300000);
+	incr["paths"].push_back({{"path", "/incr_b"}, {"recursive", true}});
+	addLotIfMissing(incr);
+	addLotIfMissing(createLotJSON("incr_other", "owner1", "/incr_c", true, 1.0,
+								  1.0, now, now + 240000, now + 300000));
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(4);
+	populatePurgeElement(elements[0], "", -1, 1, 4);
+	populatePurgeElement(elements[1], "incr_a", 0, 0, 0);
+	populatePurgeElement(elements[2], "incr_b", 0, 0, 0);
+	populatePurgeElement(elements[3], "incr_c", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 2048;
+	elements[2].m_usage.m_StBlocks = 4096;
+	elements[3].m_usage.m_StBlocks = 1024;
+	elements[0].m_usage.m_StBlocks = 2048 + 4096 + 1024;
+	purge_shot.m_dir_vec = elements;
+
+	auto lotManTotalB = [](const std::string &lot) {
+		XrdPurgeLotManTest reader;
+		const auto &usage = reader.testFetchLotUsage({lot});
+		auto it = usage.find(lot);
+		return it == usage.end() ? -1 : it->second.totalB;
+	};
+
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(purgePin.ConfigPurgePin(
+		(LMSetupTeardown::tmp_dir + " incremental=on").c_str()));
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(lotManTotalB("incr"), (2048 + 4096) * BLKSZ);
+	EXPECT_EQ(lotManTotalB("incr_other"), 1024 * BLKSZ);
+
+	// Change what LotMan thinks incr_other holds, so it shows whether the
+	// plugin sends /incr_c again
+	json tampered = json::array(
+		{{{"path", "incr_c"}, {"size_GB", 0.0}, {"includes_subdirs", false}}});
+	char *err;
+	ASSERT_EQ(lotman_update_lot_usage_by_dir(tampered.dump().c_str(), false,
+											 &err),
+			  0)
+		<< err;
+
+	// Only /incr_b changed, but incr's usage also comes from /incr_a, so
+	// both are sent. /incr_c didn't change and isn't.
+	elements[2].m_usage.m_StBlocks = 8192;
+	elements[0].m_usage.m_StBlocks = 2048 + 8192 + 1024;
+	purge_shot.m_dir_vec = elements;
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(lotManTotalB("incr"), (2048 + 8192) * BLKSZ);
+	EXPECT_EQ(lotManTotalB("incr_other"), 0);
+}
+
+TEST_F(LMSetupTeardown, UnchangedLotCandidatesTest) {
+	const std::string lotHome = createLotHome("unchanged_candidates");
+	auto now = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   std::chrono::system_clock::now().time_since_epoch())
+				   .count();
+	for (const char *lot : {"steady", "busy"}) {
+		addLotIfMissing(createLotJSON(lot, "owner1", std::string("/") + lot,
+									  true, 1.0, 1.0, now - 2000, now - 1000,
+									  now - 1000));
+	}
+
+	XrdPfc::DataFsPurgeshot purge_shot;
+	std::vector<XrdPfc::DirPurgeElement> elements(3);
+	populatePurgeElement(elements[0], "", -1, 1, 3);
+	populatePurgeElement(elements[1], "steady", 0, 0, 0);
+	populatePurgeElement(elements[2], "busy", 0, 0, 0);
+	elements[1].m_usage.m_StBlocks = 2048;
+	elements[2].m_usage.m_StBlocks = 1024;
+	elements[0].m_usage.m_StBlocks = 2048 + 1024;
+	purge_shot.m_dir_vec = elements;
+
+	auto purgeList = [](XrdPurgeLotManTest &purgePin) {
+		std::map<std::string, long long> dirs;
+		for (const auto &dirInfo : purgePin.refDirInfos()) {
+			dirs[dirInfo.path] = dirInfo.nBytesToRecover;
+		}
+		return dirs;
+	};
+
+	XrdPurgeLotManCycleTest purgePin;
+	ASSERT_TRUE(purgePin.ConfigPurgePin((lotHome + " del").c_str()));
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(purgePin.testCandidatesComputed(), 2);
+	EXPECT_EQ(purgePin.testCandidatesReused(), 0);
+
+	// Only /busy changed, so only busy's candidates are worked out again.
+	// Both lots are still purged, just as if everything had been worked out
+	// afresh.
+	elements[2].m_usage.m_StBlocks = 4096;
+	elements[0].m_usage.m_StBlocks = 2048 + 4096;
+	purge_shot.m_dir_vec = elements;
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(purgePin.testCandidatesComputed(), 1);
+	EXPECT_EQ(purgePin.testCandidatesReused(), 1);
+	XrdPurgeLotManCycleTest fresh;
+	ASSERT_TRUE(fresh.ConfigPurgePin((lotHome + " del").c_str()));
+	fresh.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(fresh.testCandidatesComputed(), 2);
+	EXPECT_EQ(purgeList(purgePin).size(), 2);
+	EXPECT_EQ(purgeList(purgePin), purgeList(fresh));
+
+	// Nothing changed at all
+	purgePin.GetBytesToRecover(purge_shot);
+	EXPECT_EQ(purgePin.testCandidatesComputed(), 0);
+	EXPECT_EQ(purgePin.testCandidatesReused(), 2);
 }
 
 /*